@@ -1,31 +1,104 @@
 #pragma once
+#include <cstddef>
 #include <functional>
+#include <memory>
+#include <new>
 #include <stdlib.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+// Buffers of destroyed arenas are kept for the next arenas of the process instead of going back to
+// malloc, so a long-running compiler (royc --server) reuses memory whose pages are already mapped.
+//
+// During constant evaluation, where neither malloc nor placement new is available, every node is
+// a separate allocation that the arena deletes when it is destroyed.
 class ArenaAllocator {
 public:
-    inline explicit ArenaAllocator(size_t bytes)
+    constexpr explicit ArenaAllocator(size_t bytes)
         : m_size(bytes)
     {
-        m_buffer = malloc(m_size);
+        if (std::is_constant_evaluated()) {
+            return;
+        }
+        m_buffer = take_spare(m_size);
+        if (m_buffer == nullptr) {
+            m_buffer = malloc(m_size);
+        }
         m_offset = m_buffer;
     }
+    // Returns a value-initialized T. Destructors are never run, the memory is released with the arena.
     template<typename T>
-    inline T* alloc() {
+    constexpr T* alloc() {
+        if (std::is_constant_evaluated()) {
+            auto owned = new Owned<T>();
+            m_owned.push_back(owned);
+            return &owned->value;
+        }
+        size_t remaining = m_size - (static_cast<std::byte*>(m_offset) - static_cast<std::byte*>(m_buffer));
         void* offset = m_offset;
-        m_offset = static_cast<T*>(offset) + sizeof(T);
-        return static_cast<T*>(offset);
+        if (std::align(alignof(T), sizeof(T), offset, remaining) == nullptr) {
+            throw std::bad_alloc();
+        }
+        m_offset = static_cast<std::byte*>(offset) + sizeof(T);
+        return new (offset) T();
     }
     inline ArenaAllocator(const ArenaAllocator& other) = delete;
 
     inline ArenaAllocator& operator=(const ArenaAllocator& other) = delete;
 
-    inline ~ArenaAllocator() {
-        free(m_buffer);
+    constexpr ~ArenaAllocator() {
+        if (std::is_constant_evaluated()) {
+            for (const OwnedBase* owned : m_owned) {
+                delete owned;
+            }
+            return;
+        }
+        std::vector<std::pair<void*, size_t>>& spares = spare_buffers();
+        if (spares.size() < max_spare_buffers) {
+            spares.emplace_back(m_buffer, m_size);
+        }
+        else {
+            free(m_buffer);
+        }
     }
 
 private:
+    struct OwnedBase {
+        constexpr virtual ~OwnedBase() = default;
+    };
+
+    template<typename T>
+    struct Owned final : OwnedBase {
+        T value {};
+        // Spelled out, GCC will not run an implicit one during constant evaluation
+        constexpr ~Owned() override {}
+    };
+
+    static constexpr size_t max_spare_buffers = 4;
+
+    static std::vector<std::pair<void*, size_t>>& spare_buffers() {
+        thread_local std::vector<std::pair<void*, size_t>> spares;
+        return spares;
+    }
+
+    // Takes a spare buffer of at least size bytes, growing size to the whole buffer.
+    static void* take_spare(size_t& size) {
+        std::vector<std::pair<void*, size_t>>& spares = spare_buffers();
+        for (auto it = spares.begin(); it != spares.end(); ++it) {
+            if (it->second >= size) {
+                void* buffer = it->first;
+                size = it->second;
+                spares.erase(it);
+                return buffer;
+            }
+        }
+        return nullptr;
+    }
+
     size_t m_size;
-    void *m_buffer;
-    void *m_offset;
+    void *m_buffer = nullptr;
+    void *m_offset = nullptr;
+    // The nodes allocated during constant evaluation
+    std::vector<OwnedBase*> m_owned {};
 };
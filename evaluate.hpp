@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "parser.hpp"
+
+// Runs a program on its AST instead of compiling it, with the same semantics as the generated
+// code: values wrap modulo 2^64, a test is true when nonzero, operands and call arguments are
+// evaluated left to right, a function sees only its own variables and falls off its end
+// returning 0. Everything is constexpr, so royc::compile below can run a program while the C++
+// that embeds it is being compiled.
+//
+// Errors the generator would report, and dividing by zero, which would trap, end the program with a
+// diagnostic; during constant evaluation that makes the embedding C++ fail to compile. Nodes are
+// dispatched with get_if rather than visitors to keep each level of RoyC recursion to a few C++
+// calls, as compilers bound the depth of constant evaluation (GCC at 512 by default).
+class Evaluator {
+public:
+    constexpr explicit Evaluator(const NodeProg& prog)
+        : m_prog(prog)
+    {}
+
+    // The value the program exits with.
+    [[nodiscard]] constexpr uint64_t run() {
+        for (const NodeStmt& stmt : m_prog.stmts) {
+            if (exec(stmt) == Flow::exited) {
+                return m_exit_code;
+            }
+        }
+        error("Program ends without exit");
+        return 0;
+    }
+
+private:
+    enum class Flow {
+        next,
+        returned,
+        exited,
+    };
+
+    struct Var {
+        std::string name;
+        uint64_t value;
+    };
+
+    [[noreturn]] static void error(const std::string& msg) {
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    constexpr Var& var(const std::string& name) {
+        for (size_t i = m_vars.size(); i-- > m_frame;) {
+            if (m_vars[i].name == name) {
+                return m_vars[i];
+            }
+        }
+        error("Undeclared identifier: " + name);
+    }
+
+    constexpr Flow exec_scope(const NodeScope* scope) {
+        const size_t vars = m_vars.size();
+        Flow flow = Flow::next;
+        for (const NodeStmt* stmt : scope->stmts) {
+            flow = exec(*stmt);
+            if (flow != Flow::next) {
+                break;
+            }
+        }
+        m_vars.resize(vars);
+        return flow;
+    }
+
+    constexpr Flow exec(const NodeStmt& stmt) {
+        if (m_exiting) {
+            return Flow::exited;
+        }
+        Flow flow = Flow::next;
+        if (const auto stmt_exit = std::get_if<NodeStmtExit*>(&stmt.var)) {
+            const uint64_t code = eval((*stmt_exit)->expr);
+            if (!m_exiting) {
+                m_exit_code = code;
+                m_exiting = true;
+            }
+        }
+        else if (const auto stmt_let = std::get_if<NodeStmtLet*>(&stmt.var)) {
+            const std::string& name = (*stmt_let)->ident.value.value();
+            for (size_t i = m_frame; i < m_vars.size(); i++) {
+                if (m_vars.at(i).name == name) {
+                    error("Identifier already used: " + name);
+                }
+            }
+            const uint64_t value = eval((*stmt_let)->expr);
+            m_vars.push_back({.name = name, .value = value});
+        }
+        else if (const auto scope = std::get_if<NodeScope*>(&stmt.var)) {
+            flow = exec_scope(*scope);
+        }
+        else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt.var)) {
+            flow = exec_if(*stmt_if);
+        }
+        else if (const auto stmt_assign = std::get_if<NodeStmtAssign*>(&stmt.var)) {
+            const uint64_t value = eval((*stmt_assign)->expr);
+            var((*stmt_assign)->ident.value.value()).value = value;
+        }
+        else if (const auto stmt_while = std::get_if<NodeStmtWhile*>(&stmt.var)) {
+            while (flow == Flow::next && eval((*stmt_while)->expr) != 0) {
+                flow = exec_scope((*stmt_while)->scope);
+            }
+        }
+        else {
+            m_return_value = eval(std::get<NodeStmtReturn*>(stmt.var)->expr);
+            flow = Flow::returned;
+        }
+        return m_exiting ? Flow::exited : flow;
+    }
+
+    constexpr Flow exec_if(const NodeStmtIf* stmt_if) {
+        if (eval(stmt_if->expr) != 0) {
+            return exec_scope(stmt_if->scope);
+        }
+        std::optional<NodeIfPred*> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                if (eval((*elif)->expr) != 0) {
+                    return exec_scope((*elif)->scope);
+                }
+                pred = (*elif)->pred;
+            }
+            else {
+                return exec_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+            }
+        }
+        return Flow::next;
+    }
+
+    constexpr uint64_t call(const NodeTermCall* term_call) {
+        const std::string& name = term_call->ident.value.value();
+        const auto func = std::find_if(m_prog.funcs.begin(), m_prog.funcs.end(), [&](const NodeFunc* func) {
+            return func->ident.value.value() == name;
+        });
+        if (func == m_prog.funcs.end()) {
+            error("Undeclared function: " + name);
+        }
+        if ((*func)->params.size() != term_call->args.size()) {
+            error("Function " + name + " takes " + std::to_string((*func)->params.size()) + " arguments but "
+                  + std::to_string(term_call->args.size()) + " were given");
+        }
+        std::vector<Var> args;
+        for (size_t i = 0; i < term_call->args.size(); i++) {
+            args.push_back({.name = (*func)->params.at(i).value.value(), .value = eval(term_call->args.at(i))});
+        }
+        const size_t caller_frame = std::exchange(m_frame, m_vars.size());
+        m_vars.insert(m_vars.end(), args.begin(), args.end());
+        const Flow flow = exec_scope((*func)->scope);
+        m_vars.resize(m_frame);
+        m_frame = caller_frame;
+        return flow == Flow::returned ? m_return_value : 0;
+    }
+
+    constexpr uint64_t eval(const NodeExpr* expr) {
+        if (m_exiting) {
+            return 0;
+        }
+        if (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (std::holds_alternative<NodeTermIntLit*>((*term)->var)) {
+                const std::optional<uint64_t> value = int_lit_value(expr);
+                if (!value.has_value()) {
+                    error("Integer literal does not fit 64 bits");
+                }
+                return value.value();
+            }
+            if (const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+                return var((*term_ident)->ident.value.value()).value;
+            }
+            if (const auto term_paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                return eval((*term_paren)->expr);
+            }
+            return call(std::get<NodeTermCall*>((*term)->var));
+        }
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        if (const auto add = std::get_if<NodeBinExprAdd*>(&bin_expr->var)) {
+            return eval((*add)->lhs) + eval((*add)->rhs);
+        }
+        if (const auto multi = std::get_if<NodeBinExprMulti*>(&bin_expr->var)) {
+            return eval((*multi)->lhs) * eval((*multi)->rhs);
+        }
+        if (const auto sub = std::get_if<NodeBinExprSub*>(&bin_expr->var)) {
+            return eval((*sub)->lhs) - eval((*sub)->rhs);
+        }
+        const NodeBinExprDiv* div = std::get<NodeBinExprDiv*>(bin_expr->var);
+        const uint64_t lhs = eval(div->lhs);
+        const uint64_t rhs = eval(div->rhs);
+        if (rhs == 0 && !m_exiting) {
+            error("Division by zero");
+        }
+        return rhs == 0 ? 0 : lhs / rhs;
+    }
+
+    const NodeProg& m_prog;
+    // Variables of every active scope, innermost last
+    std::vector<Var> m_vars {};
+    // Index in m_vars of the first variable of the running function
+    size_t m_frame = 0;
+    uint64_t m_return_value = 0;
+    uint64_t m_exit_code = 0;
+    // Set once an exit has run, while the calls and statements around it unwind
+    bool m_exiting = false;
+};
+
+namespace royc {
+
+// A string literal usable as a template argument.
+template<size_t N>
+struct FixedString {
+    char chars[N] {};
+
+    consteval FixedString(const char (&str)[N]) {
+        std::copy_n(str, N, chars);
+    }
+
+    [[nodiscard]] constexpr std::string_view view() const {
+        return {chars, N - 1};
+    }
+};
+
+// Tokenizes, parses and runs source, returning the value it exits with.
+constexpr uint64_t run(std::string_view source) {
+    Tokenizer tokenizer {std::string(source)};
+    Parser parser(tokenizer.tokenize());
+    const std::optional<NodeProg> prog = parser.parse_prog();
+    return Evaluator(prog.value()).run();
+}
+
+// The exit value of Source, computed while compiling the C++ that calls it, so that
+// `royc::compile<"let x = 7; exit(x);">()` costs no more at run time than the literal 7.
+template<FixedString Source>
+consteval uint64_t compile() {
+    return run(Source.view());
+}
+
+// Operands and arguments are evaluated in source order, as by the generated code with or without
+// inlining: the program of tests/call_order.rc exits from h(1) before e(2) or e(3) runs. main.cpp
+// includes this header so that every build checks it.
+static_assert(compile<"fn h(a) { if (a) { exit(a); } return h(a - 1); } "
+                      "fn e(a) { exit(a); return a; } "
+                      "fn g(a, b) { return a + b; } "
+                      "let x = g(h(1) + e(2), e(3)); exit(x);">() == 1);
+
+}
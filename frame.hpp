@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <variant>
+
+#include "parser.hpp"
+
+// Assigns every `let` a fixed 8-byte slot in the frame of _start or of its function, whose
+// parameters take the first slots. Slots of a scope are released when it closes, so disjoint
+// sibling scopes (e.g. if/elif/else arms) share them.
+class FrameLayout {
+public:
+    inline explicit FrameLayout(const NodeProg& prog) {
+        for (const NodeStmt& stmt : prog.stmts) {
+            layout_stmt(stmt);
+        }
+    }
+
+    inline explicit FrameLayout(const NodeFunc& func)
+        : m_depth(func.params.size())
+        , m_slot_count(func.params.size())
+    {
+        layout_scope(func.scope);
+    }
+
+    [[nodiscard]] size_t slot(const NodeStmtLet* stmt_let) const {
+        return m_slots.at(stmt_let);
+    }
+
+    // Slot of the index-th parameter of a function.
+    [[nodiscard]] static size_t param_slot(size_t index) {
+        return index;
+    }
+
+    [[nodiscard]] size_t slot_count() const {
+        return m_slot_count;
+    }
+
+    // Bytes the prologue reserves below the return address.
+    [[nodiscard]] size_t size() const {
+        return m_slot_count * 8;
+    }
+
+private:
+    void layout_scope(const NodeScope* scope) {
+        const size_t depth = m_depth;
+        for (const NodeStmt* stmt : scope->stmts) {
+            layout_stmt(*stmt);
+        }
+        m_depth = depth;
+    }
+
+    void layout_stmt(const NodeStmt& stmt) {
+        struct StmtVisitor {
+            FrameLayout& frame;
+            void operator()(const NodeStmtExit*) const {}
+            void operator()(const NodeStmtLet* stmt_let) const {
+                frame.m_slots[stmt_let] = frame.m_depth++;
+                frame.m_slot_count = std::max(frame.m_slot_count, frame.m_depth);
+            }
+            void operator()(const NodeScope* scope) const {
+                frame.layout_scope(scope);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                frame.layout_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    frame.layout_if_pred(stmt_if->pred.value());
+                }
+            }
+            void operator()(const NodeStmtAssign*) const {}
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                frame.layout_scope(stmt_while->scope);
+            }
+            void operator()(const NodeStmtReturn*) const {}
+        };
+        StmtVisitor visitor {.frame = *this};
+        std::visit(visitor, stmt.var);
+    }
+
+    void layout_if_pred(const NodeIfPred* pred) {
+        struct PredVisitor {
+            FrameLayout& frame;
+            void operator()(const NodeIfPredElif* elif) const {
+                frame.layout_scope(elif->scope);
+                if (elif->pred.has_value()) {
+                    frame.layout_if_pred(elif->pred.value());
+                }
+            }
+            void operator()(const NodeIfPredElse* else_) const {
+                frame.layout_scope(else_->scope);
+            }
+        };
+        PredVisitor visitor {.frame = *this};
+        std::visit(visitor, pred->var);
+    }
+
+    std::unordered_map<const NodeStmtLet*, size_t> m_slots {};
+    size_t m_depth = 0;
+    size_t m_slot_count = 0;
+};
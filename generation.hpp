@@ -1,95 +1,63 @@
 #pragma once
 
 #include <cassert>
+#include <limits>
+#include <unordered_set>
 #include <utility>
 #include <algorithm>
 #include <bits/ranges_algo.h>
 
+#include "frame.hpp"
+#include "loop.hpp"
 #include "parser.hpp"
+#include "peephole.hpp"
+#include "profile.hpp"
+#include "selection.hpp"
+
+struct GeneratorOptions {
+    // Source path for nasm %line directives; empty disables line info.
+    std::string debug_file {};
+    // Profile written by an instrumented build at exit (-fprofile-generate); empty to not instrument.
+    std::string profile_generate {};
+    // Arm counts from an earlier instrumented run (-fprofile-use).
+    std::optional<std::vector<uint64_t>> profile {};
+    // Favor smaller code over faster code (-Os).
+    bool optimize_size = false;
+    // Expressions whose operands and value fit in 32 bits, from the value-range analysis.
+    std::unordered_set<const NodeExpr*> narrow {};
+};
+
 class Generator {
 public:
-    inline explicit Generator(NodeProg prog)
+    inline explicit Generator(NodeProg prog, GeneratorOptions options = {})
         : m_prog(std::move(prog))
-    {}
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            Generator& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("    rax");
-            }
-            void operator()(const NodeTermIdent* term_ident) const {
-                const auto it = std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "    QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]\n";
-                gen.push(offset.str());
-            }
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    };
-    void gen_bin_expr(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            Generator& gen;
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    xor rdx, rdx\n";
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-        };
-
-        BinExprVisitor visitor {.gen = *this};
-        std::visit(visitor, bin_expr->var);
-    };
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            Generator& gen;
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
+        , m_options(std::move(options))
+        , m_start {.layout = FrameLayout(m_prog)}
+        , m_arms(m_prog)
+        , m_selector(m_output,
+            [this](const Token& ident) { return var_operand(ident); },
+            [this](const std::string& reg) { push(reg); },
+            [this](const std::string& reg) { pop(reg); })
+    {
+        if (m_options.profile.has_value() && m_options.profile.value().size() != m_arms.count()) {
+            std::cerr << "[Profile Error] Profile has " << m_options.profile.value().size()
+                      << " counters but the program has " << m_arms.count() << " if/elif/else arms" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        for (const NodeExpr* expr : m_options.narrow) {
+            m_selector.narrow(expr);
+        }
+        for (const NodeFunc* func : m_prog.funcs) {
+            if (!m_funcs.try_emplace(func->ident.value.value(), func).second) {
+                std::cerr << "Function already defined: " << func->ident.value.value() << std::endl;
+                exit(EXIT_FAILURE);
             }
-        };
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
+        }
+    }
+    // Evaluates expr through instruction selection and returns the register holding its value.
+    std::string gen_expr(const NodeExpr* expr) {
+        for_each_subexpr(expr, [this](const NodeExpr* sub) { check_call(sub); });
+        return m_selector.select(expr);
     }
     void gen_scope(const NodeScope* scope) {
         begin_scope();
@@ -99,126 +67,665 @@ public:
         end_scope();
     }
      void gen_stmt(const NodeStmt& stmt) {
+        gen_line(stmt.line);
         struct StmtVisitor {
             Generator& gen;
+            int line;
             void operator()(const NodeStmtExit* stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    pop rax\n";
-                // Pop all variables from the stack!!
-                for (auto var : gen.m_vars) {
-                    gen.m_output << "    pop rbx\n";
+                const std::string reg = gen.gen_expr(stmt_exit->expr);
+                if (gen.m_options.optimize_size) {
+                    gen.m_output << "    mov rax, " << reg << "\n";
+                    gen.m_output << "    jmp " << exit_label << "\n";
+                }
+                else {
+                    gen.gen_exit(reg, gen.m_frame != &gen.m_start);
                 }
-                gen.m_output << "    ret\n";
             }
             void operator()(const NodeStmtLet* stmt_let) const {
-                const auto it = std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == stmt_let->ident.value.value();
-                });
-                if (it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(),.stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-                gen.pop("rax");
-                gen.push("rax");
+                gen.check_unused(stmt_let->ident.value.value());
+                const std::string reg = gen.gen_expr(stmt_let->expr);
+                const size_t slot = gen.m_frame->layout.slot(stmt_let);
+                gen.m_frame->vars.push_back({.name = stmt_let->ident.value.value(), .slot = slot, .reg = gen.m_frame->slot_reg(slot)});
+                gen.m_output << "    mov " << gen.var_operand(stmt_let->ident) << ", " << reg << "\n";
             }
             void operator()(const NodeStmtAssign* stmt_assign) const {
-                auto it = std::ranges::find_if(gen.m_vars, [&](const Var& var) {
-                    return var.name == stmt_assign->ident.value.value();
-                });
-                if (it == gen.m_vars.end()) {
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
+                const std::string reg = gen.gen_expr(stmt_assign->expr);
+                gen.m_output << "    mov " << gen.var_operand(stmt_assign->ident) << ", " << reg << "\n";
+                gen.gen_induction_update(stmt_assign);
             }
             void operator()(const NodeScope* scope) const {
                 gen.gen_scope(scope);
             }
             void operator()(const NodeStmtIf* stmt_if) const {
                 std::cout << "start if stmt\n";
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
-                }
-                else {
-                    gen.m_output << label << ":\n";
-                }
+                gen.gen_if(stmt_if);
                 gen.m_output << "    ;; /if\n";
             }
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                gen.gen_while(stmt_while, line);
+            }
+            void operator()(const NodeStmtReturn* stmt_return) const {
+                const std::string reg = gen.gen_expr(stmt_return->expr);
+                gen.m_output << "    mov rax, " << reg << "\n";
+                gen.m_output << "    jmp " << gen.m_frame->return_label << "\n";
+            }
         };
 
-        StmtVisitor visitor {.gen = *this};
+        StmtVisitor visitor {.gen = *this, .line = stmt.line};
         std::visit(visitor, stmt.var);
     }
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label)
-    {
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
-
-            void operator()(const NodeIfPredElif* elif) const {
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << label << ":\n";
-                if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
+    // Lays out an if/elif/else chain. Without a profile every arm follows its test. With one, the
+    // hottest arm falls through from its test, the others are branched to: warm arms sit after the
+    // chain and cold arms move to the end of the program. The tests themselves still run in source
+    // order (see can_swap). -Os without a profile shares the arms' tails.
+    void gen_if(const NodeStmtIf* stmt_if) {
+        std::vector<IfArm> arms = if_arms(stmt_if);
+        if (m_options.optimize_size && !m_options.profile.has_value()) {
+            gen_if_shared_tail(arms);
+            return;
+        }
+        if (m_options.profile.has_value()) {
+            reorder_arms(arms);
+        }
+        uint64_t total = 0;
+        for (const IfArm& arm : arms) {
+            total += arm_count(arm);
+        }
+        std::optional<size_t> hot;
+        if (total != 0) {
+            hot = std::ranges::max_element(arms, [&](const IfArm& a, const IfArm& b) {
+                return arm_count(a) < arm_count(b);
+            }) - arms.begin();
+        }
+        const std::string end_label = create_label();
+        std::vector<std::pair<std::string, IfArm>> warm;
+        std::vector<std::pair<std::string, IfArm>> cold;
+        for (size_t i = 0; i < arms.size(); i++) {
+            const IfArm& arm = arms.at(i);
+            if (arm.test == nullptr) {
+                gen_arm(arm);
+                break;
+            }
+            gen_line(arm.line);
+            const std::string reg = gen_expr(arm.test);
+            m_output << "    test " << reg << ", " << reg << "\n";
+            if (hot.has_value() && i != hot.value()) {
+                const std::string label = create_label();
+                m_output << "    jnz " << label << "\n";
+                const bool is_cold = !m_in_cold && arm_count(arm) * 100 <= total * cold_percent;
+                (is_cold ? cold : warm).emplace_back(label, arm);
+            }
+            else if (i + 1 == arms.size()) {
+                m_output << "    jz " << end_label << "\n";
+                gen_arm(arm);
+            }
+            else {
+                const std::string next_label = create_label();
+                m_output << "    jz " << next_label << "\n";
+                gen_arm(arm);
+                m_output << "    jmp " << end_label << "\n";
+                m_output << next_label << ":\n";
+            }
+        }
+        if (!warm.empty()) {
+            m_output << "    jmp " << end_label << "\n";
+        }
+        for (size_t i = 0; i < warm.size(); i++) {
+            m_output << warm.at(i).first << ":\n";
+            gen_arm(warm.at(i).second);
+            if (i + 1 != warm.size()) {
+                m_output << "    jmp " << end_label << "\n";
+            }
+        }
+        if (!cold.empty()) {
+            std::swap(m_output, m_cold);
+            m_in_cold = true;
+            m_line = 0;
+            for (const auto& [label, arm] : cold) {
+                m_output << label << ":\n";
+                gen_arm(arm);
+                m_output << "    jmp " << end_label << "\n";
+            }
+            m_in_cold = false;
+            m_line = 0;
+            std::swap(m_output, m_cold);
+        }
+        m_output << end_label << ":\n";
+    }
+    // Emits a rotated loop: the test sits at the bottom, so each iteration takes a single branch.
+    // Before entering, variables the loop assigns are loaded into registers, products of an
+    // induction variable and a constant get a register updated by addition whenever the variable
+    // steps, and pure invariant subexpressions are computed once. Registers run out before these
+    // do in large loops; whatever does not fit is left as it was.
+    void gen_while(const NodeStmtWhile* stmt_while, int line) {
+        const LoopInfo info(stmt_while);
+        std::vector<std::string> reserved;
+        m_output << "    ;; while\n";
+        std::vector<size_t> carried;
+        for (const std::string& name : info.assigned()) {
+            std::vector<Var>& vars = m_frame->vars;
+            const auto it = std::ranges::find_if(vars, [&](const Var& var) { return var.name == name; });
+            if (it == vars.end() || it->reg.has_value()) {
+                continue;
+            }
+            const std::optional<std::string> reg = m_selector.reserve();
+            if (!reg.has_value()) {
+                break;
+            }
+            m_output << "    mov " << reg.value() << ", " << var_operand(it->name) << "\n";
+            it->reg = reg.value();
+            reserved.push_back(reg.value());
+            carried.push_back(it - vars.begin());
+        }
+        std::vector<const NodeExpr*> pinned;
+        const size_t reductions = m_reductions.size();
+        for (const LoopInfo::ScaledInduction& scaled : info.scaled_inductions()) {
+            if (m_selector.is_pinned(scaled.expr)) {
+                continue;
+            }
+            const auto same = std::ranges::find_if(m_reductions.begin() + static_cast<std::ptrdiff_t>(reductions), m_reductions.end(),
+                [&](const Reduction& reduction) { return reduction.name == scaled.name && reduction.factor == scaled.factor; });
+            if (same != m_reductions.end()) {
+                m_selector.pin(scaled.expr, same->reg);
+                pinned.push_back(scaled.expr);
+                continue;
+            }
+            const std::optional<std::string> reg = m_selector.reserve();
+            if (!reg.has_value()) {
+                break;
+            }
+            if (scaled.factor <= std::numeric_limits<int32_t>::max()) {
+                m_output << "    imul " << reg.value() << ", " << var_operand(scaled.name) << ", " << scaled.factor << "\n";
+            }
+            else {
+                m_output << "    mov " << reg.value() << ", " << scaled.factor << "\n";
+                m_output << "    imul " << reg.value() << ", " << var_operand(scaled.name) << "\n";
+            }
+            m_reductions.push_back({.name = scaled.name, .factor = scaled.factor, .reg = reg.value()});
+            m_selector.pin(scaled.expr, reg.value());
+            pinned.push_back(scaled.expr);
+            reserved.push_back(reg.value());
+        }
+        for (const NodeExpr* invariant : info.invariants()) {
+            if (m_selector.is_pinned(invariant)) {
+                continue;
+            }
+            const std::optional<std::string> reg = m_selector.reserve();
+            if (!reg.has_value()) {
+                break;
+            }
+            const std::string value = gen_expr(invariant);
+            m_output << "    mov " << reg.value() << ", " << value << "\n";
+            m_selector.pin(invariant, reg.value());
+            pinned.push_back(invariant);
+            reserved.push_back(reg.value());
+        }
+        const std::string body_label = create_label();
+        const std::string test_label = create_label();
+        m_output << "    jmp " << test_label << "\n";
+        m_output << body_label << ":\n";
+        gen_scope(stmt_while->scope);
+        m_output << test_label << ":\n";
+        m_line = 0;
+        gen_line(line);
+        const std::string reg = gen_expr(stmt_while->expr);
+        m_output << "    test " << reg << ", " << reg << "\n";
+        m_output << "    jnz " << body_label << "\n";
+        for (size_t i = 0; i < carried.size(); i++) {
+            Var& var = m_frame->vars.at(carried.at(i));
+            var.reg.reset();
+            m_output << "    mov " << var_operand(var.name) << ", " << reserved.at(i) << "\n";
+        }
+        for (const NodeExpr* expr : pinned) {
+            m_selector.unpin(expr);
+        }
+        m_reductions.resize(reductions);
+        for (auto it = reserved.rbegin(); it != reserved.rend(); ++it) {
+            m_selector.unreserve(*it);
+        }
+        m_output << "    ;; /while\n";
+    }
+    // Emits a function following the calling convention in selection.hpp. Parameters are stored
+    // into the first slots of the function's frame, except in leaf functions: those that call
+    // nothing and have few enough variables keep every slot in a caller-saved register, so they
+    // need no frame and usually save no registers either.
+    void gen_func(const NodeFunc* func) {
+        Frame frame {.layout = FrameLayout(*func), .return_label = create_label()};
+        const bool leaf = calls_in(func->scope).empty() && func->params.size() <= arg_regs.size()
+            && frame.layout.slot_count() <= leaf_regs.size();
+        if (leaf) {
+            frame.slot_regs.resize(frame.layout.slot_count());
+            std::vector<std::string> unused(leaf_regs.begin(), leaf_regs.end());
+            for (size_t i = 0; i < func->params.size(); i++) {
+                const auto it = std::ranges::find(unused, arg_regs.at(i));
+                if (it != unused.end()) {
+                    frame.slot_regs.at(FrameLayout::param_slot(i)) = *it;
+                    unused.erase(it);
                 }
             }
+            for (std::string& reg : frame.slot_regs) {
+                if (reg.empty()) {
+                    reg = unused.front();
+                    unused.erase(unused.begin());
+                }
+                [[maybe_unused]] const bool reserved = m_selector.reserve(reg);
+                assert(reserved);
+            }
+        }
+        std::stringstream body;
+        std::swap(m_output, body);
+        m_frame = &frame;
+        // The prologue carries the function's own line
+        m_line = func->line;
+        m_selector.take_touched();
+        begin_scope();
+        for (size_t i = 0; i < func->params.size(); i++) {
+            check_unused(func->params.at(i).value.value());
+            const size_t slot = FrameLayout::param_slot(i);
+            frame.vars.push_back({.name = func->params.at(i).value.value(), .slot = slot, .reg = frame.slot_reg(slot)});
+        }
+        const std::vector<NodeStmt*>& stmts = func->scope->stmts;
+        for (const NodeStmt* stmt : stmts) {
+            const auto stmt_return = std::get_if<NodeStmtReturn*>(&stmt->var);
+            if (stmt_return != nullptr && stmt == stmts.back()) {
+                // The epilogue follows, no need to jump to it
+                gen_line(stmt->line);
+                const std::string reg = gen_expr((*stmt_return)->expr);
+                m_output << "    mov rax, " << reg << "\n";
+            }
+            else {
+                gen_stmt(*stmt);
+            }
+        }
+        if (stmts.empty() || !std::holds_alternative<NodeStmtReturn*>(stmts.back()->var)) {
+            m_output << "    mov rax, 0\n";
+        }
+        const std::vector<Var> params(frame.vars.begin(), frame.vars.begin() + func->params.size());
+        end_scope();
+        std::swap(m_output, body);
 
-            void operator()(const NodeIfPredElse* else_) const {
-                gen.gen_scope(else_->scope);
+        std::vector<std::string> saved;
+        const std::unordered_set<std::string> touched = m_selector.take_touched();
+        for (const std::string_view reg : callee_saved_regs) {
+            if (touched.contains(std::string(reg))) {
+                saved.emplace_back(reg);
             }
-        };
-        PredVisitor visitor { .gen = *this, .end_label = end_label};
-        std::visit(visitor, pred->var);
+        }
+        m_output << func_label(func->ident.value.value()) << ":\n";
+        m_line = 0;
+        gen_line(func->line);
+        for (const std::string& reg : saved) {
+            m_output << "    push " << reg << "\n";
+        }
+        if (frame.size() != 0) {
+            m_output << "    sub rsp, " << frame.size() << "\n";
+        }
+        for (size_t i = 0; i < func->params.size(); i++) {
+            const Var& param = params.at(i);
+            if (param.reg.has_value()) {
+                if (param.reg.value() != arg_regs.at(i)) {
+                    m_output << "    mov " << param.reg.value() << ", " << arg_regs.at(i) << "\n";
+                }
+            }
+            else if (i < arg_regs.size()) {
+                m_output << "    mov QWORD [rsp + " << param.slot * 8 << "], " << arg_regs.at(i) << "\n";
+            }
+            else {
+                // Above the frame, the saved registers and the return address
+                const size_t offset = frame.size() + 8 * (saved.size() + 1 + i - arg_regs.size());
+                m_output << "    mov rax, QWORD [rsp + " << offset << "]\n";
+                m_output << "    mov QWORD [rsp + " << param.slot * 8 << "], rax\n";
+            }
+        }
+        m_output << body.str();
+        m_output << frame.return_label << ":\n";
+        if (frame.size() != 0) {
+            m_output << "    add rsp, " << frame.size() << "\n";
+        }
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            m_output << "    pop " << *it << "\n";
+        }
+        m_output << "    ret\n";
+        for (const std::string& reg : frame.slot_regs) {
+            m_selector.unreserve(reg);
+        }
+        m_frame = &m_start;
+        m_line = 0;
     }
     [[nodiscard]] std::string gen_prog() {
         m_output << "global _start\n_start:\n";
+        gen_prologue();
+        if (!m_prog.funcs.empty()) {
+            // Lets exit unwind from inside functions
+            m_output << "    mov [rel royc_start_rsp], rsp\n";
+        }
         for (const NodeStmt& stmt : m_prog.stmts) {
             gen_stmt(stmt);
         }
+        if (m_options.optimize_size) {
+            m_output << exit_label << ":\n";
+            gen_exit("rax", !m_prog.funcs.empty());
+        }
+        for (const NodeFunc* func : m_prog.funcs) {
+            gen_func(func);
+        }
+        m_output << m_cold.str();
+        if (!m_options.profile_generate.empty()) {
+            gen_profile_runtime();
+        }
+        if (!m_prog.funcs.empty()) {
+            m_output << "section .data\n";
+            m_output << "align 8\n";
+            m_output << "royc_start_rsp:\n";
+            m_output << "    dq 0\n";
+        }
+        if (m_options.optimize_size) {
+            return shorten_encodings(m_output.str());
+        }
         return m_output.str();
     }
+    [[nodiscard]] const Selector::Stats& isel_stats() const {
+        return m_selector.stats();
+    }
 private:
+    struct IfArm {
+        const NodeExpr* test; // nullptr for else
+        const NodeScope* scope;
+        int line;
+    };
+
+    static std::vector<IfArm> if_arms(const NodeStmtIf* stmt_if) {
+        std::vector<IfArm> arms {{.test = stmt_if->expr, .scope = stmt_if->scope, .line = 0}};
+        std::optional<NodeIfPred*> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                arms.push_back({.test = (*elif)->expr, .scope = (*elif)->scope, .line = (*elif)->line});
+                pred = (*elif)->pred;
+            }
+            else {
+                arms.push_back({.test = nullptr, .scope = std::get<NodeIfPredElse*>(pred.value()->var)->scope, .line = 0});
+                pred = {};
+            }
+        }
+        return arms;
+    }
+
+    [[nodiscard]] uint64_t arm_count(const IfArm& arm) const {
+        if (!m_options.profile.has_value()) {
+            return 0;
+        }
+        return m_options.profile.value().at(m_arms.index(arm.scope));
+    }
+
+    // Two arms can trade places only if their tests are never both true. RoyC tests are plain
+    // nonzero checks, so that is only provable when one of them is a literal zero, a test that
+    // never passes. A profile therefore never changes the order in which live tests run; it only
+    // moves such dead tests behind hotter arms and arm bodies out of line.
+    static bool can_swap(const IfArm& a, const IfArm& b) {
+        if (a.test == nullptr || b.test == nullptr || !is_pure(a.test) || !is_pure(b.test)) {
+            return false;
+        }
+        return int_lit_value(a.test) == 0 || int_lit_value(b.test) == 0;
+    }
+
+    // Moves frequently taken arms in front of literal-zero tests, the only reordering can_swap allows.
+    void reorder_arms(std::vector<IfArm>& arms) const {
+        bool swapped = true;
+        while (swapped) {
+            swapped = false;
+            for (size_t i = 1; i < arms.size(); i++) {
+                if (arm_count(arms.at(i)) > arm_count(arms.at(i - 1)) && can_swap(arms.at(i - 1), arms.at(i))) {
+                    std::swap(arms.at(i - 1), arms.at(i));
+                    swapped = true;
+                }
+            }
+        }
+    }
+
+    // Keeps the registers holding multiples of an induction variable in step with it.
+    void gen_induction_update(const NodeStmtAssign* stmt_assign) {
+        for (const Reduction& reduction : m_reductions) {
+            if (reduction.name != stmt_assign->ident.value.value()) {
+                continue;
+            }
+            const uint64_t delta = induction_step(stmt_assign).value() * reduction.factor;
+            const auto signed_delta = static_cast<int64_t>(delta);
+            if (signed_delta == 0) {
+                continue;
+            }
+            if (signed_delta >= std::numeric_limits<int32_t>::min() && signed_delta <= std::numeric_limits<int32_t>::max()) {
+                m_output << "    add " << reduction.reg << ", " << signed_delta << "\n";
+            }
+            else {
+                m_output << "    mov rax, " << delta << "\n";
+                m_output << "    add " << reduction.reg << ", rax\n";
+            }
+        }
+    }
+
+    // Returns what gen writes instead of emitting it.
+    template<typename Gen>
+    std::string capture(Gen gen) {
+        std::stringstream code;
+        std::swap(m_output, code);
+        gen();
+        std::swap(m_output, code);
+        return code.str();
+    }
+
+    void gen_arm(const IfArm& arm) {
+        if (!m_options.profile_generate.empty()) {
+            m_output << "    inc QWORD [rel royc_counters + " << m_arms.index(arm.scope) * 8 << "]\n";
+        }
+        gen_scope(arm.scope);
+    }
+
+    // The -Os layout: arms follow their tests as without a profile, but the instructions every arm
+    // ends with are emitted once, after the last arm, which falls into them, and the other arms jump
+    // there. Identical instructions do the same thing wherever they run, so only labels, which
+    // never repeat, keep a line out of the shared tail.
+    void gen_if_shared_tail(const std::vector<IfArm>& arms) {
+        std::vector<std::string> tests;
+        std::vector<std::vector<std::string>> bodies;
+        for (const IfArm& arm : arms) {
+            tests.push_back(capture([&] {
+                if (arm.test != nullptr) {
+                    gen_line(arm.line);
+                    const std::string reg = gen_expr(arm.test);
+                    m_output << "    test " << reg << ", " << reg << "\n";
+                }
+            }));
+            std::stringstream body(capture([&] { gen_arm(arm); }));
+            bodies.emplace_back();
+            for (std::string line; std::getline(body, line);) {
+                bodies.back().push_back(line);
+            }
+        }
+        size_t shared = 0;
+        while (arms.size() > 1) {
+            const std::vector<std::string>& first = bodies.front();
+            const bool same = std::ranges::all_of(bodies, [&](const std::vector<std::string>& body) {
+                return body.size() > shared
+                    && body.at(body.size() - 1 - shared) == first.at(first.size() - 1 - shared);
+            });
+            if (!same || !first.at(first.size() - 1 - shared).starts_with("    ")) {
+                break;
+            }
+            shared++;
+        }
+        const std::string end_label = create_label();
+        const std::string tail_label = shared > 0 ? create_label() : end_label;
+        for (size_t i = 0; i < arms.size(); i++) {
+            m_output << tests.at(i);
+            const bool last = i + 1 == arms.size();
+            std::string next_label;
+            if (arms.at(i).test != nullptr) {
+                next_label = last ? end_label : create_label();
+                m_output << "    jz " << next_label << "\n";
+            }
+            const std::vector<std::string>& body = bodies.at(i);
+            for (size_t line = 0; line < body.size() - shared; line++) {
+                m_output << body.at(line) << "\n";
+            }
+            if (!last) {
+                m_output << "    jmp " << tail_label << "\n";
+                m_output << next_label << ":\n";
+            }
+        }
+        if (shared > 0) {
+            m_output << tail_label << ":\n";
+            const std::vector<std::string>& body = bodies.back();
+            for (size_t line = body.size() - shared; line < body.size(); line++) {
+                m_output << body.at(line) << "\n";
+            }
+        }
+        m_output << end_label << ":\n";
+    }
+
+    // Writes the arm counters to the profile file. Called at every exit of an instrumented build.
+    void gen_profile_runtime() {
+        m_output << "royc_dump_profile:\n";
+        m_output << "    push rbp\n";
+        m_output << "    mov rbp, rsp\n";
+        m_output << "    and rsp, -16\n";
+        m_output << "    sub rsp, 64\n";
+        m_output << "    lea rcx, [rel royc_profile_path]\n";
+        m_output << "    mov edx, 0x40000000\n"; // GENERIC_WRITE
+        m_output << "    xor r8d, r8d\n";
+        m_output << "    xor r9d, r9d\n";
+        m_output << "    mov QWORD [rsp + 32], 2\n"; // CREATE_ALWAYS
+        m_output << "    mov QWORD [rsp + 40], 128\n"; // FILE_ATTRIBUTE_NORMAL
+        m_output << "    mov QWORD [rsp + 48], 0\n";
+        m_output << "    call CreateFileA\n";
+        m_output << "    cmp rax, -1\n";
+        m_output << "    je .done\n";
+        m_output << "    mov [rsp + 56], rax\n";
+        m_output << "    mov rcx, rax\n";
+        m_output << "    lea rdx, [rel royc_profile]\n";
+        m_output << "    mov r8d, " << profile_magic.size() + 8 * (m_arms.count() + 1) << "\n";
+        m_output << "    lea r9, [rsp + 48]\n";
+        m_output << "    mov QWORD [rsp + 32], 0\n";
+        m_output << "    call WriteFile\n";
+        m_output << "    mov rcx, [rsp + 56]\n";
+        m_output << "    call CloseHandle\n";
+        m_output << ".done:\n";
+        m_output << "    mov rsp, rbp\n";
+        m_output << "    pop rbp\n";
+        m_output << "    ret\n";
+        m_output << "extern CreateFileA\n";
+        m_output << "extern WriteFile\n";
+        m_output << "extern CloseHandle\n";
+        m_output << "section .data\n";
+        m_output << "align 8\n";
+        m_output << "royc_profile:\n";
+        m_output << "    db \"" << profile_magic << "\"\n";
+        m_output << "    dq " << m_arms.count() << "\n";
+        m_output << "royc_counters:\n";
+        m_output << "    times " << m_arms.count() << " dq 0\n";
+        m_output << "royc_profile_path:\n";
+        m_output << "    db \"" << m_options.profile_generate << "\", 0\n";
+    }
+
+    // Every variable lives in a fixed slot, so the frame of _start is set up and torn down once.
+    void gen_prologue() {
+        if (m_start.size() != 0) {
+            m_output << "    sub rsp, " << m_start.size() << "\n";
+        }
+    }
+    // Ends the program with the value in reg. unwind first drops the frames of every active function.
+    void gen_exit(const std::string& reg, bool unwind) {
+        if (!m_options.profile_generate.empty()) {
+            push(reg);
+            m_output << "    call royc_dump_profile\n";
+            pop("rax");
+        }
+        else if (reg != "rax") {
+            m_output << "    mov rax, " << reg << "\n";
+        }
+        if (unwind) {
+            m_output << "    mov rsp, [rel royc_start_rsp]\n";
+        }
+        gen_epilogue();
+        m_output << "    ret\n";
+    }
+    void gen_epilogue() {
+        if (m_start.size() != 0) {
+            m_output << "    add rsp, " << m_start.size() << "\n";
+        }
+    }
+    // Attributes the following instructions to a source line. With -fwin64, nasm -g only writes
+    // CodeView (cv8) line tables, which Windows debuggers read; there is no DWARF .debug_line.
+    void gen_line(int line) {
+        if (m_options.debug_file.empty() || line == 0 || line == m_line) {
+            return;
+        }
+        m_output << "%line " << line << "+0 " << m_options.debug_file << "\n";
+        m_line = line;
+    }
     void push(const std::string& reg) {
         m_output << "    push " << reg << "\n";
-        m_stack_size++;
+        m_frame->stack_size++;
     }
     void pop(const std::string& reg) {
         m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+        m_frame->stack_size--;
     }
 
     void begin_scope() {
-        m_scopes.push_back(m_vars.size());
+        m_frame->scopes.push_back(m_frame->vars.size());
     }
     void end_scope() {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+        m_frame->vars.resize(m_frame->scopes.back());
+        m_frame->scopes.pop_back();
+    }
+    void check_unused(const std::string& name) const {
+        const auto it = std::ranges::find_if(m_frame->vars, [&](const Var& var) {
+            return var.name == name;
+        });
+        if (it != m_frame->vars.cend()) {
+            std::cerr << "Identifier already used: " << name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    void check_call(const NodeExpr* expr) const {
+        const auto term = std::get_if<NodeTerm*>(&expr->var);
+        if (term == nullptr) {
+            return;
+        }
+        const auto call = std::get_if<NodeTermCall*>(&(*term)->var);
+        if (call == nullptr) {
+            return;
+        }
+        const std::string& name = (*call)->ident.value.value();
+        const auto it = m_funcs.find(name);
+        if (it == m_funcs.end()) {
+            std::cerr << "Undeclared function: " << name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (it->second->params.size() != (*call)->args.size()) {
+            std::cerr << "Function " << name << " takes " << it->second->params.size() << " arguments but "
+                      << (*call)->args.size() << " were given" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    std::string var_operand(const Token& ident) const {
+        return var_operand(ident.value.value());
+    }
+    // The register a loop or leaf function keeps the variable in, otherwise its frame slot.
+    std::string var_operand(const std::string& name) const {
+        const auto it = std::ranges::find_if(m_frame->vars, [&](const Var& var) {
+            return var.name == name;
+        });
+        if (it == m_frame->vars.cend()) {
+            std::cerr << "Undeclared identifier: " << name << std::endl;
+            exit(EXIT_FAILURE);
         }
-        m_scopes.pop_back();
+        if (it->reg.has_value()) {
+            return it->reg.value();
+        }
+        std::stringstream offset;
+        offset << "QWORD [rsp + " << (m_frame->stack_size + it->slot) * 8 << "]";
+        return offset.str();
     }
     std::string create_label() {
         std::stringstream ss;
@@ -229,12 +736,58 @@ private:
 
     struct Var {
         std::string name;
-        size_t stack_loc;
+        size_t slot;
+        std::optional<std::string> reg {};
+    };
+    // A register a loop keeps equal to name * factor
+    struct Reduction {
+        std::string name;
+        uint64_t factor;
+        std::string reg;
+    };
+    // The frame of _start or of the function being generated
+    struct Frame {
+        FrameLayout layout;
+        // Registers pushed on top of the frame while spilling or calling
+        size_t stack_size = 0;
+        std::vector<Var> vars {};
+        std::vector<size_t> scopes {};
+        // Register of every slot in a leaf function, which then has no frame
+        std::vector<std::string> slot_regs {};
+        // Where `return` jumps to
+        std::string return_label {};
+
+        [[nodiscard]] std::optional<std::string> slot_reg(size_t slot) const {
+            if (slot_regs.empty()) {
+                return {};
+            }
+            return slot_regs.at(slot);
+        }
+
+        // Bytes reserved below the return address and the saved registers
+        [[nodiscard]] size_t size() const {
+            return slot_regs.empty() ? layout.size() : 0;
+        }
     };
+    // Registers a leaf function can keep its variables in without saving them
+    static constexpr std::array<std::string_view, 7> leaf_regs {"rdi", "rsi", "rcx", "r8", "r9", "r10", "r11"};
+    static constexpr std::array<std::string_view, 5> callee_saved_regs {"rbx", "r12", "r13", "r14", "r15"};
+
     const NodeProg m_prog;
+    const GeneratorOptions m_options;
+    Frame m_start;
+    Frame* m_frame = &m_start;
+    std::unordered_map<std::string, const NodeFunc*> m_funcs {};
+    const ArmCounters m_arms;
     std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
+    // Arms a profile showed to be rarely taken, emitted after the rest of the program
+    std::stringstream m_cold;
+    bool m_in_cold = false;
+    Selector m_selector;
+    std::vector<Reduction> m_reductions {};
     int m_label_count = 0;
+    int m_line = 0;
+    static constexpr uint64_t cold_percent = 1;
+    // Under -Os every exit jumps to one copy of the exit sequence, placed here
+    static constexpr std::string_view exit_label = "royc_exit";
 };
\ No newline at end of file
@@ -0,0 +1,570 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+#include "arena.hpp"
+#include "parser.hpp"
+
+// Replaces calls by copies of the called function's body where the cost model expects a gain.
+//
+// A call is only expanded in a statement that evaluates an expression once at the point it
+// stands (exit, let, assignment, return); the body goes in front of that statement, its
+// variables renamed apart, and the call is replaced by the expression of the body's trailing
+// return. What the statement evaluates before the call and could exit or trap on, a call left
+// out of line or a division, is first moved into a `let` of its own, so the body still runs
+// after it as in source order. Calls in if/elif/while tests stay calls. Recursive functions and
+// functions returning from anywhere but their last statement are never expanded.
+//
+// The cost of expanding is the size of the body in AST nodes. It is worth paying when it does
+// not exceed what the call itself costs (saving live registers, passing arguments, the frame),
+// plus a bonus per literal argument, which the copy can use as an immediate, and a larger one
+// inside loops, where removing the call keeps the hot path call-free. A function with a single
+// call site is always expanded, as its out-of-line copy then disappears.
+class Inliner {
+public:
+    struct Stats {
+        size_t sites = 0;
+        size_t inlined = 0;
+        size_t removed = 0;
+    };
+
+    inline explicit Inliner(const NodeProg& prog)
+        : m_prog(prog)
+        , m_allocator(1024 * 1024 * 4)
+    {
+        for (const NodeFunc* func : m_prog.funcs) {
+            m_funcs.try_emplace(func->ident.value.value(), func);
+        }
+        for (const NodeTermCall* call : program_calls(m_prog)) {
+            m_call_counts[call->ident.value.value()]++;
+        }
+    }
+
+    inline Inliner(const Inliner& other) = delete;
+
+    inline Inliner& operator=(const Inliner& other) = delete;
+
+    // The inlined program. Its nodes live in the inliner's arena or the original program's.
+    [[nodiscard]] NodeProg run() {
+        for (const NodeFunc* func : m_prog.funcs) {
+            rewrite_func(func);
+        }
+        NodeProg prog;
+        const NodeScope* body = rewrite_scope(m_prog.stmts, false);
+        for (const NodeStmt* stmt : body->stmts) {
+            prog.stmts.push_back(*stmt);
+        }
+        // Keep the functions still reachable through calls
+        std::unordered_set<std::string> reachable;
+        std::vector<const NodeTermCall*> pending = calls_in(body);
+        while (!pending.empty()) {
+            const std::string name = pending.back()->ident.value.value();
+            pending.pop_back();
+            const auto it = m_rewritten.find(name);
+            if (it != m_rewritten.end() && reachable.insert(name).second) {
+                const std::vector<const NodeTermCall*> calls = calls_in(it->second->scope);
+                pending.insert(pending.end(), calls.begin(), calls.end());
+            }
+        }
+        for (const NodeFunc* func : m_prog.funcs) {
+            const std::string& name = func->ident.value.value();
+            if (m_funcs.at(name) != func) {
+                // A redefinition, left for the generator to report
+                prog.funcs.push_back(const_cast<NodeFunc*>(func));
+            }
+            else if (reachable.contains(name)) {
+                prog.funcs.push_back(m_rewritten.at(name));
+            }
+            else {
+                m_stats.removed++;
+            }
+        }
+        return prog;
+    }
+
+    [[nodiscard]] const Stats& stats() const {
+        return m_stats;
+    }
+
+private:
+    // Variable names of one expanded body mapped to their copies, parameters to their arguments.
+    struct Renaming {
+        std::unordered_map<std::string, const NodeExpr*> args {};
+        std::string suffix;
+    };
+
+    static std::vector<const NodeTermCall*> program_calls(const NodeProg& prog) {
+        std::vector<NodeStmt> stmts = prog.stmts;
+        NodeScope top;
+        for (NodeStmt& stmt : stmts) {
+            top.stmts.push_back(&stmt);
+        }
+        std::vector<const NodeTermCall*> calls = calls_in(&top);
+        for (const NodeFunc* func : prog.funcs) {
+            const std::vector<const NodeTermCall*> inner = calls_in(func->scope);
+            calls.insert(calls.end(), inner.begin(), inner.end());
+        }
+        return calls;
+    }
+
+    // Functions are rewritten callees first, so expanded bodies already have their own calls
+    // expanded. A function met again while its rewrite is under way is part of a cycle.
+    void rewrite_func(const NodeFunc* func) {
+        const std::string& name = func->ident.value.value();
+        if (m_rewritten.contains(name) || m_funcs.at(name) != func) {
+            return;
+        }
+        m_in_progress.insert(name);
+        for (const NodeTermCall* call : calls_in(func->scope)) {
+            const std::string& callee = call->ident.value.value();
+            if (m_in_progress.contains(callee)) {
+                m_recursive.insert(callee);
+            }
+            else if (m_funcs.contains(callee)) {
+                rewrite_func(m_funcs.at(callee));
+            }
+        }
+        m_in_progress.erase(name);
+        auto rewritten = m_allocator.alloc<NodeFunc>();
+        *rewritten = *func;
+        rewritten->scope = rewrite_scope(func->scope->stmts, false);
+        m_rewritten[name] = rewritten;
+    }
+
+    template<typename Stmts>
+    NodeScope* rewrite_scope(const Stmts& stmts, bool in_loop) {
+        auto scope = m_allocator.alloc<NodeScope>();
+        for (const auto& stmt : stmts) {
+            rewrite_stmt(deref(stmt), scope->stmts, in_loop);
+        }
+        return scope;
+    }
+
+    static const NodeStmt& deref(const NodeStmt& stmt) {
+        return stmt;
+    }
+
+    static const NodeStmt& deref(const NodeStmt* stmt) {
+        return *stmt;
+    }
+
+    void rewrite_stmt(const NodeStmt& stmt, std::vector<NodeStmt*>& out, bool in_loop) {
+        struct StmtVisitor {
+            Inliner& inliner;
+            std::vector<NodeStmt*>& out;
+            bool in_loop;
+            NodeStmt* stmt;
+            void operator()(NodeStmtExit* stmt_exit) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtExit>();
+                copy->expr = inliner.inline_calls(stmt_exit->expr, out, in_loop);
+                stmt->var = copy;
+            }
+            void operator()(NodeStmtLet* stmt_let) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtLet>();
+                copy->ident = stmt_let->ident;
+                copy->expr = inliner.inline_calls(stmt_let->expr, out, in_loop);
+                stmt->var = copy;
+            }
+            void operator()(NodeScope* scope) const {
+                stmt->var = inliner.rewrite_scope(scope->stmts, in_loop);
+            }
+            void operator()(NodeStmtIf* stmt_if) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtIf>();
+                copy->expr = stmt_if->expr;
+                copy->scope = inliner.rewrite_scope(stmt_if->scope->stmts, in_loop);
+                if (stmt_if->pred.has_value()) {
+                    copy->pred = inliner.rewrite_if_pred(stmt_if->pred.value(), in_loop);
+                }
+                stmt->var = copy;
+            }
+            void operator()(NodeStmtAssign* stmt_assign) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtAssign>();
+                copy->ident = stmt_assign->ident;
+                copy->expr = inliner.inline_calls(stmt_assign->expr, out, in_loop);
+                stmt->var = copy;
+            }
+            void operator()(NodeStmtWhile* stmt_while) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtWhile>();
+                copy->expr = stmt_while->expr;
+                copy->scope = inliner.rewrite_scope(stmt_while->scope->stmts, true);
+                stmt->var = copy;
+            }
+            void operator()(NodeStmtReturn* stmt_return) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtReturn>();
+                copy->expr = inliner.inline_calls(stmt_return->expr, out, in_loop);
+                stmt->var = copy;
+            }
+        };
+        auto copy = m_allocator.alloc<NodeStmt>();
+        copy->line = stmt.line;
+        // The visitor appends the statements of expanded bodies before the copy.
+        std::visit(StmtVisitor {.inliner = *this, .out = out, .in_loop = in_loop, .stmt = copy}, stmt.var);
+        out.push_back(copy);
+    }
+
+    NodeIfPred* rewrite_if_pred(const NodeIfPred* pred, bool in_loop) {
+        auto copy = m_allocator.alloc<NodeIfPred>();
+        if (const auto elif = std::get_if<NodeIfPredElif*>(&pred->var)) {
+            auto elif_copy = m_allocator.alloc<NodeIfPredElif>();
+            elif_copy->line = (*elif)->line;
+            elif_copy->expr = (*elif)->expr;
+            elif_copy->scope = rewrite_scope((*elif)->scope->stmts, in_loop);
+            if ((*elif)->pred.has_value()) {
+                elif_copy->pred = rewrite_if_pred((*elif)->pred.value(), in_loop);
+            }
+            copy->var = elif_copy;
+        }
+        else {
+            auto else_copy = m_allocator.alloc<NodeIfPredElse>();
+            else_copy->scope = rewrite_scope(std::get<NodeIfPredElse*>(pred->var)->scope->stmts, in_loop);
+            copy->var = else_copy;
+        }
+        return copy;
+    }
+
+    // Expands the calls in expr worth expanding, innermost first, appending their bodies to out.
+    // Returns expr itself if nothing changed.
+    NodeExpr* inline_calls(NodeExpr* expr, std::vector<NodeStmt*>& out, bool in_loop) {
+        std::vector<NodeExpr**> earlier;
+        return inline_calls(expr, out, in_loop, earlier);
+    }
+
+    // earlier points at the operands evaluated before expr, which spill moves out of the way of
+    // the bodies expanded in expr.
+    NodeExpr* inline_calls(NodeExpr* expr, std::vector<NodeStmt*>& out, bool in_loop, std::vector<NodeExpr**>& earlier) {
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+            return std::visit([&]<typename T>(T* bin) -> NodeExpr* {
+                NodeExpr* lhs = inline_calls(bin->lhs, out, in_loop, earlier);
+                earlier.push_back(&lhs);
+                NodeExpr* rhs = inline_calls(bin->rhs, out, in_loop, earlier);
+                earlier.pop_back();
+                if (lhs == bin->lhs && rhs == bin->rhs) {
+                    return expr;
+                }
+                auto node = m_allocator.alloc<T>();
+                node->lhs = lhs;
+                node->rhs = rhs;
+                auto copy_bin = m_allocator.alloc<NodeBinExpr>();
+                copy_bin->var = node;
+                auto copy = m_allocator.alloc<NodeExpr>();
+                copy->var = copy_bin;
+                return copy;
+            }, (*bin_expr)->var);
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        if (const auto paren = std::get_if<NodeTermParen*>(&term->var)) {
+            NodeExpr* inner = inline_calls((*paren)->expr, out, in_loop, earlier);
+            return inner == (*paren)->expr ? expr : wrap_paren(inner);
+        }
+        const auto call = std::get_if<NodeTermCall*>(&term->var);
+        if (call == nullptr) {
+            return expr;
+        }
+        // Sized up front, as earlier points into it
+        std::vector<NodeExpr*> args((*call)->args.size());
+        const size_t outer = earlier.size();
+        for (size_t i = 0; i < args.size(); i++) {
+            args.at(i) = inline_calls((*call)->args.at(i), out, in_loop, earlier);
+            earlier.push_back(&args.at(i));
+        }
+        earlier.resize(outer);
+        const bool changed = !std::equal(args.begin(), args.end(), (*call)->args.begin());
+        m_stats.sites++;
+        const std::string& name = (*call)->ident.value.value();
+        if (should_inline(name, args, in_loop)) {
+            m_stats.inlined++;
+            // The arguments themselves are bound in order by expand
+            spill(earlier, (*call)->ident.line, out);
+            return expand(m_rewritten.at(name), args, (*call)->ident.line, out);
+        }
+        if (!changed) {
+            return expr;
+        }
+        auto copy_call = m_allocator.alloc<NodeTermCall>();
+        copy_call->ident = (*call)->ident;
+        copy_call->args = std::move(args);
+        return wrap_term(copy_call);
+    }
+
+    // Moves each operand in earlier that could exit or trap into a temporary declared in out and
+    // leaves the temporary in its place. The names cannot clash: the suffix is an expansion number
+    // no renaming uses.
+    void spill(const std::vector<NodeExpr**>& earlier, int line, std::vector<NodeStmt*>& out) {
+        for (NodeExpr** operand : earlier) {
+            if (!has_effects(*operand)) {
+                continue;
+            }
+            const Token temp {.type = TokenType::ident, .line = line, .value = "spill." + std::to_string(m_expansions++)};
+            auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+            stmt_let->ident = temp;
+            stmt_let->expr = *operand;
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_let;
+            stmt->line = line;
+            out.push_back(stmt);
+            auto term_ident = m_allocator.alloc<NodeTermIdent>();
+            term_ident->ident = temp;
+            *operand = wrap_term(term_ident);
+        }
+    }
+
+    static bool has_effects(const NodeExpr* expr) {
+        bool effects = false;
+        for_each_subexpr(expr, [&](const NodeExpr* sub) {
+            if (const auto term = std::get_if<NodeTerm*>(&sub->var)) {
+                effects = effects || std::holds_alternative<NodeTermCall*>((*term)->var);
+            }
+            else {
+                effects = effects || std::holds_alternative<NodeBinExprDiv*>(std::get<NodeBinExpr*>(sub->var)->var);
+            }
+        });
+        return effects;
+    }
+
+    [[nodiscard]] bool should_inline(const std::string& name, const std::vector<NodeExpr*>& args, bool in_loop) const {
+        const auto it = m_rewritten.find(name);
+        if (it == m_rewritten.end() || m_recursive.contains(name) || it->second->params.size() != args.size()) {
+            return false;
+        }
+        const NodeFunc* func = it->second;
+        if (!returns_last(func->scope)) {
+            return false;
+        }
+        if (m_call_counts.at(name) == 1) {
+            return true;
+        }
+        size_t benefit = call_cost + arg_cost * args.size() + (in_loop ? loop_bonus : 0);
+        for (const NodeExpr* arg : args) {
+            if (int_lit_value(arg).has_value()) {
+                benefit += literal_bonus;
+            }
+        }
+        return size(func->scope) <= benefit;
+    }
+
+    static bool returns_last(const NodeScope* scope) {
+        size_t returns = 0;
+        for_each_stmt(scope, [&](const NodeStmt& stmt) {
+            returns += std::holds_alternative<NodeStmtReturn*>(stmt.var);
+        });
+        if (returns == 0) {
+            return true;
+        }
+        return returns == 1 && std::holds_alternative<NodeStmtReturn*>(scope->stmts.back()->var);
+    }
+
+    static size_t size(const NodeScope* scope) {
+        size_t nodes = 0;
+        for_each_stmt(scope, [&](const NodeStmt& stmt) {
+            nodes++;
+            for (const NodeExpr* expr : stmt_exprs(stmt)) {
+                for_each_subexpr(expr, [&](const NodeExpr*) { nodes++; });
+            }
+        });
+        return nodes;
+    }
+
+    // Appends a copy of func's body to out and returns the expression of its result.
+    NodeExpr* expand(const NodeFunc* func, const std::vector<NodeExpr*>& args, int line, std::vector<NodeStmt*>& out) {
+        Renaming renaming {.suffix = "." + std::to_string(m_expansions++)};
+        std::unordered_set<std::string> assigned;
+        for_each_stmt(func->scope, [&](const NodeStmt& stmt) {
+            if (const auto stmt_assign = std::get_if<NodeStmtAssign*>(&stmt.var)) {
+                assigned.insert((*stmt_assign)->ident.value.value());
+            }
+        });
+        for (size_t i = 0; i < args.size(); i++) {
+            const std::string& param = func->params.at(i).value.value();
+            // Literals and variables the body cannot change are used in place.
+            const auto arg_term = std::get_if<NodeTerm*>(&args.at(i)->var);
+            const bool simple = arg_term != nullptr
+                && (std::holds_alternative<NodeTermIntLit*>((*arg_term)->var) || std::holds_alternative<NodeTermIdent*>((*arg_term)->var));
+            if (simple && !assigned.contains(param)) {
+                renaming.args[param] = args.at(i);
+                continue;
+            }
+            auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+            stmt_let->ident = Token {.type = TokenType::ident, .line = line, .value = param + renaming.suffix};
+            stmt_let->expr = args.at(i);
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_let;
+            stmt->line = line;
+            out.push_back(stmt);
+        }
+        const std::vector<NodeStmt*>& stmts = func->scope->stmts;
+        for (const NodeStmt* stmt : stmts) {
+            if (const auto stmt_return = std::get_if<NodeStmtReturn*>(&stmt->var)) {
+                return clone_expr((*stmt_return)->expr, renaming);
+            }
+            out.push_back(clone_stmt(*stmt, renaming));
+        }
+        auto zero = m_allocator.alloc<NodeTermIntLit>();
+        zero->int_lit = Token {.type = TokenType::int_lit, .line = line, .value = "0"};
+        return wrap_term(zero);
+    }
+
+    [[nodiscard]] Token rename(const Token& ident, const Renaming& renaming) const {
+        Token copy = ident;
+        copy.value = ident.value.value() + renaming.suffix;
+        return copy;
+    }
+
+    NodeExpr* clone_expr(const NodeExpr* expr, const Renaming& renaming) {
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+            return std::visit([&]<typename T>(const T* bin) -> NodeExpr* {
+                auto node = m_allocator.alloc<T>();
+                node->lhs = clone_expr(bin->lhs, renaming);
+                node->rhs = clone_expr(bin->rhs, renaming);
+                auto copy_bin = m_allocator.alloc<NodeBinExpr>();
+                copy_bin->var = node;
+                auto copy = m_allocator.alloc<NodeExpr>();
+                copy->var = copy_bin;
+                return copy;
+            }, (*bin_expr)->var);
+        }
+        struct TermVisitor {
+            Inliner& inliner;
+            const Renaming& renaming;
+            NodeExpr* operator()(const NodeTermIntLit* term_int_lit) const {
+                auto copy = inliner.m_allocator.alloc<NodeTermIntLit>();
+                *copy = *term_int_lit;
+                return inliner.wrap_term(copy);
+            }
+            NodeExpr* operator()(const NodeTermIdent* term_ident) const {
+                const auto arg = renaming.args.find(term_ident->ident.value.value());
+                if (arg != renaming.args.end()) {
+                    return inliner.clone_expr(arg->second, {});
+                }
+                auto copy = inliner.m_allocator.alloc<NodeTermIdent>();
+                copy->ident = inliner.rename(term_ident->ident, renaming);
+                return inliner.wrap_term(copy);
+            }
+            NodeExpr* operator()(const NodeTermParen* term_paren) const {
+                return inliner.wrap_paren(inliner.clone_expr(term_paren->expr, renaming));
+            }
+            NodeExpr* operator()(const NodeTermCall* term_call) const {
+                auto copy = inliner.m_allocator.alloc<NodeTermCall>();
+                copy->ident = term_call->ident;
+                for (const NodeExpr* arg : term_call->args) {
+                    copy->args.push_back(inliner.clone_expr(arg, renaming));
+                }
+                return inliner.wrap_term(copy);
+            }
+        };
+        return std::visit(TermVisitor {.inliner = *this, .renaming = renaming}, std::get<NodeTerm*>(expr->var)->var);
+    }
+
+    NodeScope* clone_scope(const NodeScope* scope, const Renaming& renaming) {
+        auto copy = m_allocator.alloc<NodeScope>();
+        for (const NodeStmt* stmt : scope->stmts) {
+            copy->stmts.push_back(clone_stmt(*stmt, renaming));
+        }
+        return copy;
+    }
+
+    NodeStmt* clone_stmt(const NodeStmt& stmt, const Renaming& renaming) {
+        struct StmtVisitor {
+            Inliner& inliner;
+            const Renaming& renaming;
+            NodeStmt* stmt;
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtExit>();
+                copy->expr = inliner.clone_expr(stmt_exit->expr, renaming);
+                stmt->var = copy;
+            }
+            void operator()(const NodeStmtLet* stmt_let) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtLet>();
+                copy->ident = inliner.rename(stmt_let->ident, renaming);
+                copy->expr = inliner.clone_expr(stmt_let->expr, renaming);
+                stmt->var = copy;
+            }
+            void operator()(const NodeScope* scope) const {
+                stmt->var = inliner.clone_scope(scope, renaming);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtIf>();
+                copy->expr = inliner.clone_expr(stmt_if->expr, renaming);
+                copy->scope = inliner.clone_scope(stmt_if->scope, renaming);
+                if (stmt_if->pred.has_value()) {
+                    copy->pred = inliner.clone_if_pred(stmt_if->pred.value(), renaming);
+                }
+                stmt->var = copy;
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtAssign>();
+                copy->ident = inliner.rename(stmt_assign->ident, renaming);
+                copy->expr = inliner.clone_expr(stmt_assign->expr, renaming);
+                stmt->var = copy;
+            }
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                auto copy = inliner.m_allocator.alloc<NodeStmtWhile>();
+                copy->expr = inliner.clone_expr(stmt_while->expr, renaming);
+                copy->scope = inliner.clone_scope(stmt_while->scope, renaming);
+                stmt->var = copy;
+            }
+            void operator()(const NodeStmtReturn*) const {
+                assert(false);
+            }
+        };
+        auto copy = m_allocator.alloc<NodeStmt>();
+        copy->line = stmt.line;
+        std::visit(StmtVisitor {.inliner = *this, .renaming = renaming, .stmt = copy}, stmt.var);
+        return copy;
+    }
+
+    NodeIfPred* clone_if_pred(const NodeIfPred* pred, const Renaming& renaming) {
+        auto copy = m_allocator.alloc<NodeIfPred>();
+        if (const auto elif = std::get_if<NodeIfPredElif*>(&pred->var)) {
+            auto elif_copy = m_allocator.alloc<NodeIfPredElif>();
+            elif_copy->line = (*elif)->line;
+            elif_copy->expr = clone_expr((*elif)->expr, renaming);
+            elif_copy->scope = clone_scope((*elif)->scope, renaming);
+            if ((*elif)->pred.has_value()) {
+                elif_copy->pred = clone_if_pred((*elif)->pred.value(), renaming);
+            }
+            copy->var = elif_copy;
+        }
+        else {
+            auto else_copy = m_allocator.alloc<NodeIfPredElse>();
+            else_copy->scope = clone_scope(std::get<NodeIfPredElse*>(pred->var)->scope, renaming);
+            copy->var = else_copy;
+        }
+        return copy;
+    }
+
+    template<typename T>
+    NodeExpr* wrap_term(T* node) {
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = node;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = term;
+        return expr;
+    }
+
+    NodeExpr* wrap_paren(NodeExpr* inner) {
+        auto paren = m_allocator.alloc<NodeTermParen>();
+        paren->expr = inner;
+        return wrap_term(paren);
+    }
+
+    // Rough instruction counts of a call that is not expanded
+    static constexpr size_t call_cost = 6;
+    static constexpr size_t arg_cost = 2;
+    static constexpr size_t literal_bonus = 4;
+    static constexpr size_t loop_bonus = 32;
+
+    const NodeProg m_prog;
+    std::unordered_map<std::string, const NodeFunc*> m_funcs {};
+    std::unordered_map<std::string, size_t> m_call_counts {};
+    std::unordered_map<std::string, NodeFunc*> m_rewritten {};
+    std::unordered_set<std::string> m_in_progress {};
+    std::unordered_set<std::string> m_recursive {};
+    size_t m_expansions = 0;
+    Stats m_stats {};
+    ArenaAllocator m_allocator;
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+#include "parser.hpp"
+
+// How much `name = name + c` or `name = name - c` adds to name, modulo 2^64, or nothing if the
+// assignment is not such a step.
+inline std::optional<uint64_t> induction_step(const NodeStmtAssign* stmt_assign) {
+    const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(stmt_assign->expr)->var);
+    if (bin_expr == nullptr) {
+        return {};
+    }
+    const auto is_self = [&](const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+        if (term == nullptr) {
+            return false;
+        }
+        const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+        return term_ident != nullptr && (*term_ident)->ident.value == stmt_assign->ident.value;
+    };
+    if (const auto add = std::get_if<NodeBinExprAdd*>(&(*bin_expr)->var)) {
+        if (is_self((*add)->lhs)) {
+            return int_lit_value((*add)->rhs);
+        }
+        if (is_self((*add)->rhs)) {
+            return int_lit_value((*add)->lhs);
+        }
+    }
+    else if (const auto sub = std::get_if<NodeBinExprSub*>(&(*bin_expr)->var)) {
+        if (is_self((*sub)->lhs)) {
+            if (const auto value = int_lit_value((*sub)->rhs)) {
+                return 0 - *value;
+            }
+        }
+    }
+    return {};
+}
+
+// What the body and test of a while loop read and write, for deciding what can stay in registers
+// across iterations and what can be computed once before the loop.
+class LoopInfo {
+public:
+    // A product of an induction variable and a constant: `name * factor` or `factor * name`.
+    struct ScaledInduction {
+        const NodeExpr* expr;
+        std::string name;
+        uint64_t factor;
+    };
+
+    inline explicit LoopInfo(const NodeStmtWhile* stmt_while) {
+        m_roots.push_back(stmt_while->expr);
+        scan_scope(stmt_while->scope);
+    }
+
+    // Variables the loop assigns or declares, in order of first write.
+    [[nodiscard]] const std::vector<std::string>& assigned() const {
+        return m_assigned;
+    }
+
+    // Whether name is assigned or declared anywhere in the loop.
+    [[nodiscard]] bool writes(const std::string& name) const {
+        return m_written.contains(name);
+    }
+
+    // A variable from outside the loop that only ever changes by constant steps inside it.
+    [[nodiscard]] bool is_induction(const std::string& name) const {
+        const auto it = m_stepped.find(name);
+        return it != m_stepped.end() && it->second && !m_declared.contains(name);
+    }
+
+    // Largest pure subexpressions, with at least one operator, that read nothing the loop writes.
+    [[nodiscard]] std::vector<const NodeExpr*> invariants() const {
+        std::vector<const NodeExpr*> found;
+        for (const NodeExpr* root : m_roots) {
+            collect_invariants(root, found);
+        }
+        return found;
+    }
+
+    // Products of an induction variable and a constant that is not a power of two, which would
+    // otherwise need an imul on every iteration.
+    [[nodiscard]] std::vector<ScaledInduction> scaled_inductions() const {
+        std::vector<ScaledInduction> found;
+        for (const NodeExpr* root : m_roots) {
+            collect_scaled(root, found);
+        }
+        return found;
+    }
+
+private:
+    static std::optional<std::pair<const NodeExpr*, const NodeExpr*>> operands(const NodeExpr* expr) {
+        struct BinExprVisitor {
+            std::pair<const NodeExpr*, const NodeExpr*> operator()(const NodeBinExprAdd* add) const {
+                return {add->lhs, add->rhs};
+            }
+            std::pair<const NodeExpr*, const NodeExpr*> operator()(const NodeBinExprMulti* multi) const {
+                return {multi->lhs, multi->rhs};
+            }
+            std::pair<const NodeExpr*, const NodeExpr*> operator()(const NodeBinExprSub* sub) const {
+                return {sub->lhs, sub->rhs};
+            }
+            std::pair<const NodeExpr*, const NodeExpr*> operator()(const NodeBinExprDiv* div) const {
+                return {div->lhs, div->rhs};
+            }
+        };
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(expr)->var);
+        if (bin_expr == nullptr) {
+            return {};
+        }
+        return std::visit(BinExprVisitor {}, (*bin_expr)->var);
+    }
+
+    static const std::string* ident_name(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+        if (term == nullptr) {
+            return nullptr;
+        }
+        const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+        return term_ident == nullptr ? nullptr : &(*term_ident)->ident.value.value();
+    }
+
+    [[nodiscard]] bool reads_written(const NodeExpr* expr) const {
+        if (const auto bin = operands(expr)) {
+            return reads_written(bin->first) || reads_written(bin->second);
+        }
+        const std::string* name = ident_name(expr);
+        return name != nullptr && writes(*name);
+    }
+
+    void collect_invariants(const NodeExpr* expr, std::vector<const NodeExpr*>& found) const {
+        const auto bin = operands(expr);
+        if (!bin.has_value()) {
+            return;
+        }
+        if (!reads_written(expr) && is_pure(expr)) {
+            found.push_back(unwrap_parens(expr));
+            return;
+        }
+        collect_invariants(bin->first, found);
+        collect_invariants(bin->second, found);
+    }
+
+    void collect_scaled(const NodeExpr* expr, std::vector<ScaledInduction>& found) const {
+        const auto bin = operands(expr);
+        if (!bin.has_value()) {
+            return;
+        }
+        if (std::holds_alternative<NodeBinExprMulti*>(std::get<NodeBinExpr*>(unwrap_parens(expr)->var)->var)) {
+            for (const auto& [var, factor] : {*bin, std::pair(bin->second, bin->first)}) {
+                const std::string* name = ident_name(var);
+                const std::optional<uint64_t> value = int_lit_value(factor);
+                if (name != nullptr && value.has_value() && !std::has_single_bit(*value) && is_induction(*name)) {
+                    found.push_back({.expr = unwrap_parens(expr), .name = *name, .factor = *value});
+                    return;
+                }
+            }
+        }
+        collect_scaled(bin->first, found);
+        collect_scaled(bin->second, found);
+    }
+
+    void scan_scope(const NodeScope* scope) {
+        for (const NodeStmt* stmt : scope->stmts) {
+            scan_stmt(*stmt);
+        }
+    }
+
+    void write(const std::string& name) {
+        if (m_written.insert(name).second) {
+            m_assigned.push_back(name);
+        }
+    }
+
+    void scan_stmt(const NodeStmt& stmt) {
+        struct StmtVisitor {
+            LoopInfo& info;
+            void operator()(const NodeStmtExit* stmt_exit) const {
+                info.m_roots.push_back(stmt_exit->expr);
+            }
+            void operator()(const NodeStmtLet* stmt_let) const {
+                info.m_roots.push_back(stmt_let->expr);
+                info.m_declared.insert(stmt_let->ident.value.value());
+                info.write(stmt_let->ident.value.value());
+            }
+            void operator()(const NodeScope* scope) const {
+                info.scan_scope(scope);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                info.m_roots.push_back(stmt_if->expr);
+                info.scan_scope(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    info.scan_if_pred(stmt_if->pred.value());
+                }
+            }
+            void operator()(const NodeStmtAssign* stmt_assign) const {
+                const std::string& name = stmt_assign->ident.value.value();
+                info.m_roots.push_back(stmt_assign->expr);
+                info.write(name);
+                const bool step = induction_step(stmt_assign).has_value();
+                const auto [it, inserted] = info.m_stepped.try_emplace(name, step);
+                it->second = it->second && step;
+            }
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                info.m_roots.push_back(stmt_while->expr);
+                info.scan_scope(stmt_while->scope);
+            }
+            void operator()(const NodeStmtReturn* stmt_return) const {
+                info.m_roots.push_back(stmt_return->expr);
+            }
+        };
+        StmtVisitor visitor {.info = *this};
+        std::visit(visitor, stmt.var);
+    }
+
+    void scan_if_pred(const NodeIfPred* pred) {
+        struct PredVisitor {
+            LoopInfo& info;
+            void operator()(const NodeIfPredElif* elif) const {
+                info.m_roots.push_back(elif->expr);
+                info.scan_scope(elif->scope);
+                if (elif->pred.has_value()) {
+                    info.scan_if_pred(elif->pred.value());
+                }
+            }
+            void operator()(const NodeIfPredElse* else_) const {
+                info.scan_scope(else_->scope);
+            }
+        };
+        PredVisitor visitor {.info = *this};
+        std::visit(visitor, pred->var);
+    }
+
+    // Every expression evaluated in the loop, including its test
+    std::vector<const NodeExpr*> m_roots {};
+    std::vector<std::string> m_assigned {};
+    std::unordered_set<std::string> m_written {};
+    std::unordered_set<std::string> m_declared {};
+    // Whether every assignment to the variable seen so far was a constant step
+    std::unordered_map<std::string, bool> m_stepped {};
+};
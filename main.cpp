@@ -1,38 +1,235 @@
+#include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <new>
 #include <optional>
 #include <sstream>
+#include <thread>
 #include <vector>
+#include "./evaluate.hpp"
 #include "./generation.hpp"
+#include "./inline.hpp"
+#include "./precompiled.hpp"
+#include "./range.hpp"
+#include "./reassociate.hpp"
+#include "./server.hpp"
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Incorrect usage. Correct usage  is..." << std::endl;
-        std::cerr << "RoyC <input.rc>" << std::endl;
+void usage() {
+    std::cerr << "Incorrect usage. Correct usage  is..." << std::endl;
+    std::cerr << "RoyC [-S] [-g] [-o=<name>] [-fno-inline] [-fno-reassociate] [-fno-value-range] [-Os] [-fprofile-generate=<file>] [-fprofile-use=<file>] [-emit-ast=<file>] <input.rc|input.rcast>" << std::endl;
+    std::cerr << "RoyC --server[=<socket>]" << std::endl;
+    std::cerr << "RoyC --connect[=<socket>] <arguments>..." << std::endl;
+    std::cerr << "  -S                         stop after writing out.asm, without assembling or linking" << std::endl;
+    std::cerr << "  -o=<name>                  write <name>.asm, <name>.o and <name>.exe instead of out.*" << std::endl;
+    std::cerr << "  -g                         emit CodeView source line info for debuggers" << std::endl;
+    std::cerr << "  -fno-inline                keep every call instead of expanding small functions in place" << std::endl;
+    std::cerr << "  -fno-reassociate           keep + and * chains nested as written instead of balancing them" << std::endl;
+    std::cerr << "  -fno-value-range           skip removing dead arms and narrowing arithmetic by value ranges" << std::endl;
+    std::cerr << "  -Os                        favor smaller code over faster code" << std::endl;
+    std::cerr << "  -fprofile-generate=<file>  count if/elif/else arms and write them to <file> at exit" << std::endl;
+    std::cerr << "  -fprofile-use=<file>       lay out if/elif/else chains using counts from <file>" << std::endl;
+    std::cerr << "  -emit-ast=<file>           also write the parsed program as a precompiled .rcast AST" << std::endl;
+    std::cerr << "  --server[=<socket>]        keep compiling requests from a Unix domain socket (not on Windows)" << std::endl;
+    std::cerr << "  --connect[=<socket>]       have the server compile the remaining arguments (not on Windows)" << std::endl;
+}
+
+// Runs an assembler or linker command and copies everything it prints to std::cerr, which a
+// compile server sends back to its client, and returns its exit status.
+int run_tool(const std::string& command) {
+#ifdef _WIN32
+    FILE* pipe = _popen((command + " 2>&1").c_str(), "r");
+#else
+    FILE* pipe = popen((command + " 2>&1").c_str(), "r");
+#endif
+    if (pipe == nullptr) {
+        std::cerr << "Could not run " << command << std::endl;
         return EXIT_FAILURE;
     }
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
-    }
-    Tokenizer tokenizer(contents);
-    std::vector<Token> tokens = tokenizer.tokenize();
-    for ([[maybe_unused]] const auto& token : tokens) {
-        std::string val = token.value.has_value() ? token.value.value() : "";
-        std::cout << "Token type: " << (unsigned) token.type
-                  << " Value: " << val << std::endl;
-    }
-    Parser parser(tokens);
-    std::optional<NodeProg> prog = parser.parse_prog();
+    char buffer[4096];
+    size_t got = 0;
+    while ((got = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        std::cerr.write(buffer, static_cast<std::streamsize>(got));
+    }
+    std::cerr << std::flush;
+#ifdef _WIN32
+    return _pclose(pipe);
+#else
+    return pclose(pipe);
+#endif
+}
+
+// Bytes of code in the COFF object at path, or nothing if it cannot be read as one.
+std::optional<uint32_t> text_size(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    const std::string object((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const auto read = [&](size_t offset, size_t size) -> std::optional<uint32_t> {
+        if (offset + size > object.size()) {
+            return {};
+        }
+        uint32_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(object[offset + i])) << (8 * i);
+        }
+        return value;
+    };
+    // The file header holds the section count at offset 2 and the optional header's size at 16.
+    // Section headers follow it, 40 bytes each, with the name first and the data size at 16.
+    const std::optional<uint32_t> sections = read(2, 2);
+    const std::optional<uint32_t> optional_header = read(16, 2);
+    if (!sections.has_value() || !optional_header.has_value()) {
+        return {};
+    }
+    uint32_t size = 0;
+    for (size_t i = 0; i < sections.value(); i++) {
+        const size_t header = 20 + optional_header.value() + 40 * i;
+        const std::optional<uint32_t> raw_size = read(header + 16, 4);
+        if (!raw_size.has_value()) {
+            return {};
+        }
+        const std::string name = object.substr(header, 8);
+        if (name.substr(0, name.find('\0')) == ".text") {
+            size += raw_size.value();
+        }
+    }
+    return size;
+}
+
+int compile(const std::vector<std::string>& args) {
+    std::optional<std::string> input_path;
+    std::optional<std::string> emit_ast_path;
+    GeneratorOptions options;
+    std::string output = "out";
+    bool debug = false;
+    bool inline_calls = true;
+    bool reassociate = true;
+    bool value_range = true;
+    bool assemble = true;
+    for (const std::string& arg : args) {
+        if (arg == "-S") {
+            assemble = false;
+        }
+        else if (arg == "-g") {
+            debug = true;
+        }
+        else if (arg.starts_with("-o=")) {
+            output = arg.substr(std::string("-o=").size());
+        }
+        else if (arg == "-fno-inline") {
+            inline_calls = false;
+        }
+        else if (arg == "-fno-reassociate") {
+            reassociate = false;
+        }
+        else if (arg == "-fno-value-range") {
+            value_range = false;
+        }
+        else if (arg == "-Os") {
+            options.optimize_size = true;
+        }
+        else if (arg.starts_with("-fprofile-generate=")) {
+            options.profile_generate = arg.substr(std::string("-fprofile-generate=").size());
+        }
+        else if (arg.starts_with("-fprofile-use=")) {
+            const std::string path = arg.substr(std::string("-fprofile-use=").size());
+            options.profile = read_profile(path);
+            if (!options.profile.has_value()) {
+                std::cerr << "[Profile Error] Could not read profile " << path << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg.starts_with("-emit-ast=")) {
+            emit_ast_path = arg.substr(std::string("-emit-ast=").size());
+        }
+        else if (!input_path.has_value()) {
+            input_path = arg;
+        }
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!input_path.has_value()) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    // The nodes of prog live in the arena of whichever of these produced it
+    std::optional<Parser> parser;
+    std::optional<AstReader> reader;
+    std::optional<NodeProg> prog;
+    if (input_path.value().ends_with(".rcast")) {
+        reader.emplace(input_path.value());
+        prog = reader->read();
+    }
+    else {
+        std::string contents;
+        {
+            std::stringstream contents_stream;
+            std::fstream input(input_path.value(), std::ios::in);
+            contents_stream << input.rdbuf();
+            contents = contents_stream.str();
+        }
+        Tokenizer tokenizer(contents);
+        std::vector<Token> tokens = tokenizer.tokenize();
+        for ([[maybe_unused]] const auto& token : tokens) {
+            std::string val = token.value.has_value() ? token.value.value() : "";
+            std::cout << "Token type: " << (unsigned) token.type
+                      << " Value: " << val << std::endl;
+        }
+        parser.emplace(tokens);
+        prog = parser->parse_prog();
+    }
     if (!prog.has_value()) {
         std::cerr << "Invalid program" << std::endl;
         exit(EXIT_FAILURE);
     }
+    // Line info and re-emitted ASTs name the .rc file an AST was parsed from, where it is known
+    const std::string source = reader.has_value() ? reader->source().value_or(input_path.value()) : input_path.value();
+    if (debug) {
+        options.debug_file = source;
+    }
+    if (emit_ast_path.has_value()) {
+        std::ofstream ast_file(emit_ast_path.value(), std::ios::out | std::ios::binary);
+        ast_file << AstWriter().write(prog.value(), source);
+    }
+    // Owns the nodes of the expanded bodies until generation is done
+    std::optional<Inliner> inliner;
+    if (inline_calls && !prog.value().funcs.empty()) {
+        inliner.emplace(prog.value());
+        try {
+            prog = inliner->run();
+        }
+        catch (const std::bad_alloc&) {
+            std::cerr << "[Inline Error] Out of memory expanding calls, compile with -fno-inline" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const Inliner::Stats& stats = inliner->stats();
+        std::cout << "Inlining: " << stats.inlined << " of " << stats.sites << " call sites expanded, "
+                  << stats.removed << " functions removed" << std::endl;
+    }
+    // Owns the nodes of the rebalanced chains until generation is done
+    Reassociator reassociator;
+    if (reassociate) {
+        reassociator.run(prog.value());
+        const Reassociator::Stats& stats = reassociator.stats();
+        if (stats.chains != 0) {
+            std::cout << "Reassociation: " << stats.chains << " chains balanced, longest dependency chain "
+                      << stats.depth_before << " -> " << stats.depth_after << " operations" << std::endl;
+        }
+    }
+    // Owns the nodes of the simplified branches and divisions until generation is done
+    RangeAnalyzer range_analyzer;
+    if (value_range) {
+        range_analyzer.run(prog.value());
+        options.narrow = range_analyzer.narrow();
+        const RangeAnalyzer::Stats& stats = range_analyzer.stats();
+        if (stats.branches != 0 || stats.divisions != 0 || stats.narrowed != 0) {
+            std::cout << "Value ranges: " << stats.branches << " branches removed, " << stats.divisions
+                      << " divisions removed, " << stats.narrowed << " operations narrowed to 32 bits" << std::endl;
+        }
+    }
     {
-        Generator generator(prog.value());
+        Generator generator(prog.value(), options);
         std::string program;
         try {
             program = generator.gen_prog();
@@ -41,12 +238,53 @@ int main(int argc, char *argv[]) {
             std::cout << "Failed to generate program" << std::endl;
             exit(EXIT_FAILURE);
         }
-        std::ofstream file("out.asm");
+        const Selector::Stats& stats = generator.isel_stats();
+        std::cout << "Instruction selection: " << stats.selected << " expression instructions (stack templates: "
+                  << stats.naive << ", saved " << static_cast<long>(stats.naive) - static_cast<long>(stats.selected)
+                  << ")" << std::endl;
+        std::ofstream file(output + ".asm");
         std::cout << program << std::endl << std::flush;
         file << program;
         file.close();
     }
-    system("nasm -o out.o -fwin64 out.asm");
-    system("ld -o out.exe out.o");
+    if (!assemble) {
+        return EXIT_SUCCESS;
+    }
+    const std::string object = "\"" + output + ".o\"";
+    const std::string executable = "\"" + output + ".exe\"";
+    if (run_tool(std::string(debug ? "nasm -g" : "nasm") + " -o " + object + " -fwin64 \"" + output + ".asm\"") == 0) {
+        if (const std::optional<uint32_t> size = text_size(output + ".o")) {
+            std::cout << "Code size: " << size.value() << " bytes of .text" << std::endl;
+        }
+    }
+    // Instrumented builds write their profile through kernel32
+    run_tool("ld -o " + executable + " " + object + (options.profile_generate.empty() ? "" : " -lkernel32"));
     return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (!args.empty() && (args.front().starts_with("--server") || args.front().starts_with("--connect"))) {
+#ifdef _WIN32
+        // The workers are forked, and Windows has no fork
+        std::cerr << "[Server Error] Compile servers are not supported on Windows" << std::endl;
+        return EXIT_FAILURE;
+#else
+        const std::string mode = args.front();
+        const size_t eq = mode.find('=');
+        const std::string path = eq == std::string::npos ? default_socket_path() : mode.substr(eq + 1);
+        const std::string name = mode.substr(0, eq);
+        args.erase(args.begin());
+        if (name == "--server" && args.empty()) {
+            CompileServer server(path, std::thread::hardware_concurrency(), compile);
+            return server.run();
+        }
+        if (name == "--connect") {
+            return run_client(path, args);
+        }
+        usage();
+        return EXIT_FAILURE;
+#endif
+    }
+    return compile(args);
 };
\ No newline at end of file
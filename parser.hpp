@@ -1,12 +1,17 @@
 #pragma once
 
+#include <cassert>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <stdexcept>
 #include <variant>
 #include <vector>
 
 #include "./tokenization.hpp"
 #include "./arena.hpp"
 struct NodeTermParen;
+struct NodeTermCall;
 
 struct NodeTermIntLit {
     Token int_lit;
@@ -16,7 +21,7 @@ struct NodeTermIdent {
 };
 
 struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermCall*> var;
 };
 
 struct NodeExpr;
@@ -24,6 +29,10 @@ struct NodeExpr;
 struct NodeTermParen {
     NodeExpr* expr;
 };
+struct NodeTermCall {
+    Token ident;
+    std::vector<NodeExpr*> args;
+};
 struct NodeBinExprAdd {
     NodeExpr* lhs;
     NodeExpr* rhs;
@@ -62,6 +71,7 @@ struct NodeScope {
 struct NodeIfPred;
 
 struct NodeIfPredElif {
+    int line {};
     NodeExpr* expr {};
     NodeScope* scope {};
     std::optional<NodeIfPred*> pred;
@@ -84,18 +94,202 @@ struct NodeStmtAssign {
     NodeExpr* expr {};
 };
 
+struct NodeStmtWhile {
+    NodeExpr* expr {};
+    NodeScope* scope {};
+};
+
+struct NodeStmtReturn {
+    NodeExpr* expr {};
+};
+
 
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*> var;
+    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*, NodeStmtWhile*, NodeStmtReturn*> var;
+    int line {};
+};
+
+struct NodeFunc {
+    Token ident;
+    std::vector<Token> params;
+    NodeScope* scope {};
+    int line {};
 };
 
 struct NodeProg {
     std::vector<NodeStmt> stmts;
+    std::vector<NodeFunc*> funcs;
 };
 
+// Looks through parentheses to the expression they wrap.
+constexpr const NodeExpr* unwrap_parens(const NodeExpr* expr) {
+    while (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+        const auto paren = std::get_if<NodeTermParen*>(&(*term)->var);
+        if (paren == nullptr) {
+            break;
+        }
+        expr = (*paren)->expr;
+    }
+    return expr;
+}
+
+// Value of an integer literal expression, or nothing if expr is not one or does not fit 64 bits.
+constexpr std::optional<uint64_t> int_lit_value(const NodeExpr* expr) {
+    const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+    if (term == nullptr) {
+        return {};
+    }
+    const auto int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var);
+    if (int_lit == nullptr) {
+        return {};
+    }
+    uint64_t value = 0;
+    for (const char digit : (*int_lit)->int_lit.value.value()) {
+        const uint64_t d = digit - '0';
+        if (value > (std::numeric_limits<uint64_t>::max() - d) / 10) {
+            return {};
+        }
+        value = value * 10 + d;
+    }
+    return value;
+}
+
+// Whether evaluating expr can never trap, i.e. it only divides by nonzero literals. Pure
+// expressions may be evaluated in a different order, or more or less often, than written.
+inline bool is_pure(const NodeExpr* expr) {
+    struct BinExprVisitor {
+        bool operator()(const NodeBinExprAdd* add) const {
+            return is_pure(add->lhs) && is_pure(add->rhs);
+        }
+        bool operator()(const NodeBinExprMulti* multi) const {
+            return is_pure(multi->lhs) && is_pure(multi->rhs);
+        }
+        bool operator()(const NodeBinExprSub* sub) const {
+            return is_pure(sub->lhs) && is_pure(sub->rhs);
+        }
+        bool operator()(const NodeBinExprDiv* div) const {
+            const std::optional<uint64_t> divisor = int_lit_value(div->rhs);
+            return is_pure(div->lhs) && divisor.has_value() && divisor.value() != 0;
+        }
+    };
+    const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(expr)->var);
+    if (bin_expr == nullptr) {
+        // A call may exit or never return.
+        return !std::holds_alternative<NodeTermCall*>(std::get<NodeTerm*>(unwrap_parens(expr)->var)->var);
+    }
+    return std::visit(BinExprVisitor {}, (*bin_expr)->var);
+}
+
+// Calls fn on expr and every expression below it, parents first.
+template<typename Fn>
+void for_each_subexpr(const NodeExpr* expr, Fn&& fn) {
+    fn(expr);
+    if (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+        if (const auto paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+            for_each_subexpr((*paren)->expr, fn);
+        }
+        else if (const auto call = std::get_if<NodeTermCall*>(&(*term)->var)) {
+            for (const NodeExpr* arg : (*call)->args) {
+                for_each_subexpr(arg, fn);
+            }
+        }
+        return;
+    }
+    std::visit([&](const auto* bin) {
+        for_each_subexpr(bin->lhs, fn);
+        for_each_subexpr(bin->rhs, fn);
+    }, std::get<NodeBinExpr*>(expr->var)->var);
+}
+
+// The expressions stmt evaluates itself, i.e. not those of the statements nested in it.
+inline std::vector<const NodeExpr*> stmt_exprs(const NodeStmt& stmt) {
+    struct StmtVisitor {
+        std::vector<const NodeExpr*>& exprs;
+        void operator()(const NodeStmtExit* stmt_exit) const {
+            exprs.push_back(stmt_exit->expr);
+        }
+        void operator()(const NodeStmtLet* stmt_let) const {
+            exprs.push_back(stmt_let->expr);
+        }
+        void operator()(const NodeScope*) const {}
+        void operator()(const NodeStmtIf* stmt_if) const {
+            exprs.push_back(stmt_if->expr);
+            std::optional<NodeIfPred*> pred = stmt_if->pred;
+            while (pred.has_value()) {
+                const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var);
+                if (elif == nullptr) {
+                    break;
+                }
+                exprs.push_back((*elif)->expr);
+                pred = (*elif)->pred;
+            }
+        }
+        void operator()(const NodeStmtAssign* stmt_assign) const {
+            exprs.push_back(stmt_assign->expr);
+        }
+        void operator()(const NodeStmtWhile* stmt_while) const {
+            exprs.push_back(stmt_while->expr);
+        }
+        void operator()(const NodeStmtReturn* stmt_return) const {
+            exprs.push_back(stmt_return->expr);
+        }
+    };
+    std::vector<const NodeExpr*> exprs;
+    std::visit(StmtVisitor {.exprs = exprs}, stmt.var);
+    return exprs;
+}
+
+// Calls fn on every statement of scope and of the scopes nested in it, outer statements first.
+template<typename Fn>
+void for_each_stmt(const NodeScope* scope, Fn&& fn) {
+    for (const NodeStmt* stmt : scope->stmts) {
+        fn(*stmt);
+        if (const auto inner = std::get_if<NodeScope*>(&stmt->var)) {
+            for_each_stmt(*inner, fn);
+        }
+        else if (const auto stmt_while = std::get_if<NodeStmtWhile*>(&stmt->var)) {
+            for_each_stmt((*stmt_while)->scope, fn);
+        }
+        else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+            for_each_stmt((*stmt_if)->scope, fn);
+            std::optional<NodeIfPred*> pred = (*stmt_if)->pred;
+            while (pred.has_value()) {
+                if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                    for_each_stmt((*elif)->scope, fn);
+                    pred = (*elif)->pred;
+                }
+                else {
+                    for_each_stmt(std::get<NodeIfPredElse*>(pred.value()->var)->scope, fn);
+                    pred = {};
+                }
+            }
+        }
+    }
+}
+
+// Every call made in scope.
+inline std::vector<const NodeTermCall*> calls_in(const NodeScope* scope) {
+    std::vector<const NodeTermCall*> calls;
+    for_each_stmt(scope, [&](const NodeStmt& stmt) {
+        for (const NodeExpr* expr : stmt_exprs(stmt)) {
+            for_each_subexpr(expr, [&](const NodeExpr* sub) {
+                const auto term = std::get_if<NodeTerm*>(&sub->var);
+                if (term != nullptr) {
+                    if (const auto call = std::get_if<NodeTermCall*>(&(*term)->var)) {
+                        calls.push_back(*call);
+                    }
+                }
+            });
+        }
+    });
+    return calls;
+}
+
+// Parsing is constexpr so that programs embedded in C++ can be parsed at compile time; errors end
+// constant evaluation with the diagnostic calls below.
 class Parser {
 public:
-    inline explicit Parser(const std::vector<Token>& tokens)
+    constexpr explicit Parser(const std::vector<Token>& tokens)
         : m_tokens(tokens), m_allocator(1024 * 1024 * 4) {
     }
 
@@ -125,7 +319,7 @@ public:
             return {};
         }
     }
-    std::optional<NodeTerm*> parse_term() {
+    constexpr std::optional<NodeTerm*> parse_term() {
         if (auto int_lit = try_consume(TokenType::int_lit)) {
             auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
             term_int_lit->int_lit = int_lit.value();
@@ -133,6 +327,23 @@ public:
             term->var = term_int_lit;
             return term;
 
+        } else if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
+            auto term_call = m_allocator.alloc<NodeTermCall>();
+            term_call->ident = consume();
+            consume(); // Read "("
+            if (!try_consume(TokenType::close_paren).has_value()) {
+                do {
+                    if (auto arg = parse_expr()) {
+                        term_call->args.push_back(arg.value());
+                    } else {
+                        error_expected("expression");
+                    }
+                } while (try_consume(TokenType::comma).has_value());
+                try_consume(TokenType::close_paren, "`)`");
+            }
+            auto term = m_allocator.alloc<NodeTerm>();
+            term->var = term_call;
+            return term;
         } else if (auto ident = try_consume(TokenType::ident)) {
             auto term_ident = m_allocator.alloc<NodeTermIdent>();
             term_ident->ident = ident.value();
@@ -157,7 +368,7 @@ public:
         }
     }
 
-    std::optional<NodeExpr*> parse_expr(int min_prec = 0) {
+    constexpr std::optional<NodeExpr*> parse_expr(int min_prec = 0) {
         std::optional<NodeTerm*> term_lhs = parse_term();
         if (!term_lhs.has_value()) {
             return {};
@@ -171,8 +382,6 @@ public:
             if (!prec.has_value()) break; // Not an operator token
             if (prec.value() < min_prec) break; // Operator precedence is too low
             Token op = consume();
-            const auto [type, line, value] = consume();
-            const int next_min_prec = prec.value() + 1;
             auto expr_rhs = parse_expr(prec.value() + 1);
             if (!expr_rhs.has_value()) {
                 error_expected("expression");
@@ -210,7 +419,7 @@ public:
         return expr_lhs;
     }
 
-    std::optional<NodeScope*> parse_scope() {
+    constexpr std::optional<NodeScope*> parse_scope() {
         if (!try_consume(TokenType::open_curly).has_value()) {
             return {};
         }
@@ -223,10 +432,11 @@ public:
         try_consume(TokenType::close_curly, "`}`");
         return scope;
     }
-    std::optional<NodeIfPred*> parse_if_pred() {
-        if (try_consume(TokenType::elif)) {
+    constexpr std::optional<NodeIfPred*> parse_if_pred() {
+        if (const auto elif_tok = try_consume(TokenType::elif)) {
             try_consume(TokenType::open_paren, "`(`");
             const auto elif = m_allocator.alloc<NodeIfPredElif>();
+            elif->line = elif_tok.value().line;
             if (const auto expr = parse_expr()) {
                 elif->expr = expr.value();
             } else {
@@ -257,11 +467,11 @@ public:
         return {};
     }
 
-    std::optional<NodeStmt> parse_stmt() {
+    constexpr std::optional<NodeStmt> parse_stmt() {
         if (peek().has_value() && peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren)
         {
             auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-            consume(); // Read exit
+            const int line = consume().line; // Read exit
             consume(); // Read "("
             if (auto expr = parse_expr()) {
                 stmt_exit->expr = { expr.value() };
@@ -270,7 +480,7 @@ public:
             }
             try_consume(TokenType::close_paren, "`)`");
             try_consume(TokenType::semi, "`;`");
-            return NodeStmt {.var = stmt_exit};
+            return NodeStmt {.var = stmt_exit, .line = line};
         }
         else if (peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq) {
             consume();
@@ -285,6 +495,7 @@ public:
             try_consume(TokenType::semi, "`;`");
             auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = stmt_let;
+            stmt->line = stmt_let->ident.line;
             return *stmt;
         }
         else if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() && peek(1).value().type == TokenType::eq) {
@@ -299,12 +510,15 @@ public:
             try_consume(TokenType::semi, "`;`");
             const auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = assign;
+            stmt->line = assign->ident.line;
             return *stmt;
         }
         else if (peek().has_value() && peek().value().type == TokenType::open_curly) {
+            const int line = peek().value().line;
             if (auto scope = parse_scope()) {
                 auto stmt = m_allocator.alloc<NodeStmt>();
                 stmt->var = scope.value();
+                stmt->line = line;
                 return *stmt;
             } else {
                 error_expected("scope");
@@ -327,16 +541,55 @@ public:
             stmt_if->pred = parse_if_pred();
             auto stmt = m_allocator.alloc<NodeStmt>();
             stmt->var = stmt_if;
+            stmt->line = if_.value().line;
+            return *stmt;
+        }
+        else if (auto while_ = try_consume(TokenType::while_)) {
+            try_consume(TokenType::open_paren, "`(`");
+            auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
+            if (auto expr = parse_expr()) {
+                stmt_while->expr = expr.value();
+            } else {
+                error_expected("expression");
+            }
+            try_consume(TokenType::close_paren, "`)`");
+            if (auto scope = parse_scope()) {
+                stmt_while->scope = scope.value();
+            } else {
+                error_expected("scope");
+            }
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_while;
+            stmt->line = while_.value().line;
+            return *stmt;
+        }
+        else if (auto return_ = try_consume(TokenType::return_)) {
+            if (!m_in_func) {
+                std::cerr << "[Parse Error] `return` outside of a function on line " << return_.value().line << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            auto stmt_return = m_allocator.alloc<NodeStmtReturn>();
+            if (auto expr = parse_expr()) {
+                stmt_return->expr = expr.value();
+            } else {
+                error_expected("expression");
+            }
+            try_consume(TokenType::semi, "`;`");
+            auto stmt = m_allocator.alloc<NodeStmt>();
+            stmt->var = stmt_return;
+            stmt->line = return_.value().line;
             return *stmt;
         }
         return {};
 
     };
-    std::optional<NodeProg> parse_prog() {
+    constexpr std::optional<NodeProg> parse_prog() {
         NodeProg prog;
         while (peek().has_value()) {
             //std::cout << "parse_stmt " << (unsigned) peek().value().type << std::endl;
-            if (auto stmt = parse_stmt()) {
+            if (auto func = parse_func()) {
+                prog.funcs.push_back(func.value());
+            } else if (auto stmt = parse_stmt()) {
                 prog.stmts.push_back(stmt.value());
             } else {
                 error_expected("statement");
@@ -344,8 +597,33 @@ public:
         }
         return prog;
     }
+    // fn name(param, ...) { ... }, only at the top level.
+    constexpr std::optional<NodeFunc*> parse_func() {
+        const auto fn = try_consume(TokenType::fn);
+        if (!fn.has_value()) {
+            return {};
+        }
+        auto func = m_allocator.alloc<NodeFunc>();
+        func->line = fn.value().line;
+        func->ident = try_consume(TokenType::ident, "`ident`");
+        try_consume(TokenType::open_paren, "`(`");
+        if (!try_consume(TokenType::close_paren).has_value()) {
+            do {
+                func->params.push_back(try_consume(TokenType::ident, "`ident`"));
+            } while (try_consume(TokenType::comma).has_value());
+            try_consume(TokenType::close_paren, "`)`");
+        }
+        m_in_func = true;
+        if (auto scope = parse_scope()) {
+            func->scope = scope.value();
+        } else {
+            error_expected("scope");
+        }
+        m_in_func = false;
+        return func;
+    }
 private:
-    [[nodiscard]] inline std::optional<Token> peek(int ahead = 0) const
+    [[nodiscard]] constexpr std::optional<Token> peek(int ahead = 0) const
     {
         if (m_index + ahead >= m_tokens.size()) {
             return {};
@@ -353,17 +631,17 @@ private:
             return m_tokens.at(m_index + ahead);
         }
     }
-    inline Token consume() {
+    constexpr Token consume() {
         return m_tokens.at(m_index++);
     }
-    inline Token try_consume(TokenType type, const std::string& msg) {
+    constexpr Token try_consume(TokenType type, const std::string& msg) {
         if (peek().has_value() && peek().value().type == type) {
             return consume();
         }
         error_expected(to_string(type));
         return {};
     }
-    inline std::optional<Token> try_consume(TokenType type) {
+    constexpr std::optional<Token> try_consume(TokenType type) {
         if (peek().has_value() && peek().value().type == type) {
             return consume();
         } else {
@@ -372,5 +650,6 @@ private:
     }
     const std::vector<Token> m_tokens;
     size_t m_index = 0;
+    bool m_in_func = false;
     ArenaAllocator m_allocator;
 };
\ No newline at end of file
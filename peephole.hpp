@@ -0,0 +1,96 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "selection.hpp"
+
+// Size peepholes over finished assembly, run by the generator under -Os. Each rewrite keeps what
+// the program computes and only picks a shorter encoding or drops code that cannot run:
+//   mov r64, 0        ->  xor r32, r32    (3 bytes instead of 7 to 10)
+//   mov r64, imm32    ->  mov r32, imm32  (writing a 32-bit register zeroes the upper half)
+//   code after an unconditional jmp or ret up to the next label is removed
+//   a jmp to a label it would fall through to anyway is removed
+// The xor clobbers the flags, which is safe because the generator only consumes flags in the
+// branch right after the test or cmp that set them. Picking rel8 over rel32 branches is left to
+// nasm, whose default multipass optimization already does it wherever the target is in range.
+
+namespace peephole {
+
+inline bool is_instruction(std::string_view line) {
+    return line.starts_with("    ") && !line.starts_with("    ;");
+}
+
+inline bool is_label(std::string_view line) {
+    return !line.empty() && line.front() != ' ' && line.back() == ':';
+}
+
+inline std::string shorten_mov(const std::string& line) {
+    constexpr std::string_view mov = "    mov ";
+    if (!line.starts_with(mov)) {
+        return line;
+    }
+    const std::string_view operands = std::string_view(line).substr(mov.size());
+    const size_t comma = operands.find(", ");
+    if (comma == std::string_view::npos) {
+        return line;
+    }
+    const std::optional<std::string_view> dst = reg32(operands.substr(0, comma));
+    const std::string_view src = operands.substr(comma + 2);
+    uint64_t value = 0;
+    const auto [end, ec] = std::from_chars(src.data(), src.data() + src.size(), value);
+    if (!dst.has_value() || ec != std::errc() || end != src.data() + src.size()) {
+        return line;
+    }
+    if (value == 0) {
+        return "    xor " + std::string(dst.value()) + ", " + std::string(dst.value());
+    }
+    if (value <= UINT32_MAX) {
+        return "    mov " + std::string(dst.value()) + ", " + std::string(src);
+    }
+    return line;
+}
+
+}
+
+inline std::string shorten_encodings(const std::string& program) {
+    std::vector<std::string> lines;
+    std::stringstream input(program);
+    bool reachable = true;
+    for (std::string line; std::getline(input, line);) {
+        if (!line.starts_with("    ")) {
+            reachable = true;
+        }
+        else if (!reachable && peephole::is_instruction(line)) {
+            continue;
+        }
+        lines.push_back(peephole::shorten_mov(line));
+        if (line.starts_with("    jmp ") || line == "    ret") {
+            reachable = false;
+        }
+    }
+    std::stringstream output;
+    for (size_t i = 0; i < lines.size(); i++) {
+        constexpr std::string_view jmp = "    jmp ";
+        if (lines.at(i).starts_with(jmp)) {
+            const std::string target = lines.at(i).substr(jmp.size()) + ":";
+            bool falls_through = false;
+            for (size_t next = i + 1; next < lines.size() && !peephole::is_instruction(lines.at(next)); next++) {
+                if (!peephole::is_label(lines.at(next)) && !lines.at(next).starts_with("    ")) {
+                    break;
+                }
+                falls_through = falls_through || lines.at(next) == target;
+            }
+            if (falls_through) {
+                continue;
+            }
+        }
+        output << lines.at(i) << "\n";
+    }
+    return output.str();
+}
@@ -0,0 +1,722 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "parser.hpp"
+
+// Precompiled ASTs (.rcast) let a NodeProg be loaded without tokenizing and parsing it again.
+//
+// The file is a 32-byte AstHeader followed by a payload of little-endian 32-bit words. Each node is
+// a record whose first word is its AstKind. Records refer to other records and to strings with
+// signed word offsets relative to the referring word, so the payload is valid at any address;
+// 0 means "none". Every distinct token string is stored once as a length word plus its bytes,
+// padded to a whole word. Children are written before their parents and the header holds the
+// position of the NodeProg record.
+
+constexpr std::string_view ast_magic {"RCAST\0\0\0", 8};
+// Version 2 added stmt_while, version 3 functions, version 4 the name of the source file. Older
+// files are a subset of the current format and stay loadable.
+constexpr uint32_t ast_version = 4;
+
+struct AstHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t root;       // word index of the NodeProg record
+    uint64_t words;      // payload size in words
+    uint64_t checksum;   // FNV-1a of the payload
+};
+static_assert(sizeof(AstHeader) == 32);
+
+enum class AstKind : uint32_t {
+    prog,         // count, stmt..., func count, func..., source token (the functions since version 3,
+                  // the source since version 4)
+    scope,        // count, stmt...
+    stmt_exit,    // line, expr
+    stmt_let,     // line, token, expr
+    stmt_scope,   // line, scope
+    stmt_if,      // line, expr, scope, pred
+    stmt_assign,  // line, token, expr
+    pred_elif,    // line, expr, scope, pred
+    pred_else,    // scope
+    term_int_lit, // token
+    term_ident,   // token
+    term_paren,   // expr
+    bin_add,      // lhs, rhs
+    bin_multi,    // lhs, rhs
+    bin_sub,      // lhs, rhs
+    bin_div,      // lhs, rhs
+    stmt_while,   // line, expr, scope
+    stmt_return,  // line, expr
+    term_call,    // token, count, expr...
+    func,         // line, token, count, token..., scope
+};
+
+inline uint64_t fnv1a(const void* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<const unsigned char*>(data)[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+class AstWriter {
+public:
+    // Returns the complete .rcast file for prog, parsed from the file at source.
+    [[nodiscard]] std::string write(const NodeProg& prog, const std::string& source) {
+        std::vector<size_t> stmts;
+        for (const NodeStmt& stmt : prog.stmts) {
+            stmts.push_back(write_stmt(stmt));
+        }
+        std::vector<size_t> funcs;
+        for (const NodeFunc* func : prog.funcs) {
+            funcs.push_back(write_func(func));
+        }
+        const size_t root = m_words.size();
+        m_words.push_back(static_cast<uint32_t>(AstKind::prog));
+        m_words.push_back(static_cast<uint32_t>(stmts.size()));
+        for (const size_t stmt : stmts) {
+            push_ref(stmt);
+        }
+        m_words.push_back(static_cast<uint32_t>(funcs.size()));
+        for (const size_t func : funcs) {
+            push_ref(func);
+        }
+        push_token(Token {.type = TokenType::ident, .line = 0, .value = source});
+        write_strings();
+
+        AstHeader header {};
+        std::memcpy(header.magic, ast_magic.data(), ast_magic.size());
+        header.version = ast_version;
+        header.root = static_cast<uint32_t>(root);
+        header.words = m_words.size();
+        header.checksum = fnv1a(m_words.data(), m_words.size() * sizeof(uint32_t));
+        std::string file(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.append(reinterpret_cast<const char*>(m_words.data()), m_words.size() * sizeof(uint32_t));
+        return file;
+    }
+
+private:
+    void push_ref(size_t target) {
+        m_words.push_back(static_cast<uint32_t>(static_cast<int32_t>(target) - static_cast<int32_t>(m_words.size())));
+    }
+
+    void push_token(const Token& token) {
+        m_words.push_back(static_cast<uint32_t>(token.type));
+        m_words.push_back(static_cast<uint32_t>(token.line));
+        if (token.value.has_value()) {
+            const auto [it, inserted] = m_strings.try_emplace(token.value.value());
+            if (inserted) {
+                m_string_order.push_back(token.value.value());
+            }
+            it->second.push_back(m_words.size());
+        }
+        m_words.push_back(0);
+    }
+
+    void write_strings() {
+        for (const std::string& str : m_string_order) {
+            const size_t pos = m_words.size();
+            m_words.push_back(static_cast<uint32_t>(str.size()));
+            const size_t data = m_words.size();
+            m_words.resize(data + (str.size() + 3) / 4, 0);
+            std::memcpy(m_words.data() + data, str.data(), str.size());
+            for (const size_t field : m_strings.at(str)) {
+                m_words.at(field) = static_cast<uint32_t>(static_cast<int32_t>(pos) - static_cast<int32_t>(field));
+            }
+        }
+    }
+
+    size_t write_expr(const NodeExpr* expr) {
+        struct TermVisitor {
+            AstWriter& writer;
+            size_t operator()(const NodeTermIntLit* term_int_lit) const {
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::term_int_lit));
+                writer.push_token(term_int_lit->int_lit);
+                return pos;
+            }
+            size_t operator()(const NodeTermIdent* term_ident) const {
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::term_ident));
+                writer.push_token(term_ident->ident);
+                return pos;
+            }
+            size_t operator()(const NodeTermParen* term_paren) const {
+                const size_t inner = writer.write_expr(term_paren->expr);
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::term_paren));
+                writer.push_ref(inner);
+                return pos;
+            }
+            size_t operator()(const NodeTermCall* term_call) const {
+                std::vector<size_t> args;
+                for (const NodeExpr* arg : term_call->args) {
+                    args.push_back(writer.write_expr(arg));
+                }
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::term_call));
+                writer.push_token(term_call->ident);
+                writer.m_words.push_back(static_cast<uint32_t>(args.size()));
+                for (const size_t arg : args) {
+                    writer.push_ref(arg);
+                }
+                return pos;
+            }
+        };
+        struct BinExprVisitor {
+            AstWriter& writer;
+            size_t operator()(const NodeBinExprAdd* add) const {
+                return writer.write_bin_expr(AstKind::bin_add, add->lhs, add->rhs);
+            }
+            size_t operator()(const NodeBinExprMulti* multi) const {
+                return writer.write_bin_expr(AstKind::bin_multi, multi->lhs, multi->rhs);
+            }
+            size_t operator()(const NodeBinExprSub* sub) const {
+                return writer.write_bin_expr(AstKind::bin_sub, sub->lhs, sub->rhs);
+            }
+            size_t operator()(const NodeBinExprDiv* div) const {
+                return writer.write_bin_expr(AstKind::bin_div, div->lhs, div->rhs);
+            }
+        };
+        if (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+            return std::visit(TermVisitor {.writer = *this}, (*term)->var);
+        }
+        return std::visit(BinExprVisitor {.writer = *this}, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    size_t write_bin_expr(AstKind kind, const NodeExpr* lhs, const NodeExpr* rhs) {
+        const size_t l = write_expr(lhs);
+        const size_t r = write_expr(rhs);
+        const size_t pos = m_words.size();
+        m_words.push_back(static_cast<uint32_t>(kind));
+        push_ref(l);
+        push_ref(r);
+        return pos;
+    }
+
+    size_t write_func(const NodeFunc* func) {
+        const size_t scope = write_scope(func->scope);
+        const size_t pos = m_words.size();
+        m_words.push_back(static_cast<uint32_t>(AstKind::func));
+        m_words.push_back(static_cast<uint32_t>(func->line));
+        push_token(func->ident);
+        m_words.push_back(static_cast<uint32_t>(func->params.size()));
+        for (const Token& param : func->params) {
+            push_token(param);
+        }
+        push_ref(scope);
+        return pos;
+    }
+
+    size_t write_scope(const NodeScope* scope) {
+        std::vector<size_t> stmts;
+        for (const NodeStmt* stmt : scope->stmts) {
+            stmts.push_back(write_stmt(*stmt));
+        }
+        const size_t pos = m_words.size();
+        m_words.push_back(static_cast<uint32_t>(AstKind::scope));
+        m_words.push_back(static_cast<uint32_t>(stmts.size()));
+        for (const size_t stmt : stmts) {
+            push_ref(stmt);
+        }
+        return pos;
+    }
+
+    size_t write_if_pred(const NodeIfPred* pred) {
+        struct PredVisitor {
+            AstWriter& writer;
+            size_t operator()(const NodeIfPredElif* elif) const {
+                const size_t expr = writer.write_expr(elif->expr);
+                const size_t scope = writer.write_scope(elif->scope);
+                const std::optional<size_t> next = elif->pred.has_value()
+                    ? std::optional(writer.write_if_pred(elif->pred.value()))
+                    : std::nullopt;
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::pred_elif));
+                writer.m_words.push_back(static_cast<uint32_t>(elif->line));
+                writer.push_ref(expr);
+                writer.push_ref(scope);
+                writer.push_optional_ref(next);
+                return pos;
+            }
+            size_t operator()(const NodeIfPredElse* else_) const {
+                const size_t scope = writer.write_scope(else_->scope);
+                const size_t pos = writer.m_words.size();
+                writer.m_words.push_back(static_cast<uint32_t>(AstKind::pred_else));
+                writer.push_ref(scope);
+                return pos;
+            }
+        };
+        return std::visit(PredVisitor {.writer = *this}, pred->var);
+    }
+
+    void push_optional_ref(std::optional<size_t> target) {
+        if (target.has_value()) {
+            push_ref(target.value());
+        }
+        else {
+            m_words.push_back(0);
+        }
+    }
+
+    size_t write_stmt(const NodeStmt& stmt) {
+        struct StmtVisitor {
+            AstWriter& writer;
+            int line;
+            size_t operator()(const NodeStmtExit* stmt_exit) const {
+                const size_t expr = writer.write_expr(stmt_exit->expr);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_exit, line);
+                writer.push_ref(expr);
+                return pos;
+            }
+            size_t operator()(const NodeStmtLet* stmt_let) const {
+                const size_t expr = writer.write_expr(stmt_let->expr);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_let, line);
+                writer.push_token(stmt_let->ident);
+                writer.push_ref(expr);
+                return pos;
+            }
+            size_t operator()(const NodeScope* scope) const {
+                const size_t inner = writer.write_scope(scope);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_scope, line);
+                writer.push_ref(inner);
+                return pos;
+            }
+            size_t operator()(const NodeStmtIf* stmt_if) const {
+                const size_t expr = writer.write_expr(stmt_if->expr);
+                const size_t scope = writer.write_scope(stmt_if->scope);
+                const std::optional<size_t> pred = stmt_if->pred.has_value()
+                    ? std::optional(writer.write_if_pred(stmt_if->pred.value()))
+                    : std::nullopt;
+                const size_t pos = writer.begin_stmt(AstKind::stmt_if, line);
+                writer.push_ref(expr);
+                writer.push_ref(scope);
+                writer.push_optional_ref(pred);
+                return pos;
+            }
+            size_t operator()(const NodeStmtAssign* stmt_assign) const {
+                const size_t expr = writer.write_expr(stmt_assign->expr);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_assign, line);
+                writer.push_token(stmt_assign->ident);
+                writer.push_ref(expr);
+                return pos;
+            }
+            size_t operator()(const NodeStmtWhile* stmt_while) const {
+                const size_t expr = writer.write_expr(stmt_while->expr);
+                const size_t scope = writer.write_scope(stmt_while->scope);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_while, line);
+                writer.push_ref(expr);
+                writer.push_ref(scope);
+                return pos;
+            }
+            size_t operator()(const NodeStmtReturn* stmt_return) const {
+                const size_t expr = writer.write_expr(stmt_return->expr);
+                const size_t pos = writer.begin_stmt(AstKind::stmt_return, line);
+                writer.push_ref(expr);
+                return pos;
+            }
+        };
+        return std::visit(StmtVisitor {.writer = *this, .line = stmt.line}, stmt.var);
+    }
+
+    size_t begin_stmt(AstKind kind, int line) {
+        const size_t pos = m_words.size();
+        m_words.push_back(static_cast<uint32_t>(kind));
+        m_words.push_back(static_cast<uint32_t>(line));
+        return pos;
+    }
+
+    std::vector<uint32_t> m_words {};
+    std::unordered_map<std::string, std::vector<size_t>> m_strings {};
+    std::vector<std::string> m_string_order {};
+};
+
+// Maps a .rcast file and rebuilds its NodeProg in one pass over the records. The nodes live in
+// the reader's arena, so the reader must outlive any use of the program.
+class AstReader {
+public:
+    inline explicit AstReader(const std::string& path)
+        : m_path(path)
+        , m_allocator(map(path) * 16 + 1024)
+    {}
+
+    inline AstReader(const AstReader& other) = delete;
+
+    inline AstReader& operator=(const AstReader& other) = delete;
+
+    inline ~AstReader() {
+#ifndef _WIN32
+        if (m_mapping != nullptr) {
+            munmap(m_mapping, m_mapping_size);
+        }
+#endif
+    }
+
+    [[nodiscard]] NodeProg read() {
+        if (m_size < sizeof(AstHeader)) {
+            error("truncated header");
+        }
+        AstHeader header {};
+        std::memcpy(&header, m_data, sizeof(header));
+        if (std::string_view(header.magic, sizeof(header.magic)) != ast_magic) {
+            error("not a precompiled RoyC AST");
+        }
+        if (header.version == 0 || header.version > ast_version) {
+            error("unsupported version " + std::to_string(header.version));
+        }
+        if ((m_size - sizeof(AstHeader)) % sizeof(uint32_t) != 0
+            || header.words != (m_size - sizeof(AstHeader)) / sizeof(uint32_t)) {
+            error("size does not match header");
+        }
+        m_words = reinterpret_cast<const uint32_t*>(m_data + sizeof(AstHeader));
+        m_word_count = header.words;
+        if (fnv1a(m_words, m_word_count * sizeof(uint32_t)) != header.checksum) {
+            error("checksum mismatch");
+        }
+        expect(header.root, AstKind::prog);
+        m_read.assign(m_word_count, false);
+        NodeProg prog;
+        try {
+            const uint32_t count = word(header.root + 1);
+            for (uint32_t i = 0; i < count; i++) {
+                prog.stmts.push_back(*read_stmt(ref(header.root + 2 + i)));
+            }
+            if (header.version >= 3) {
+                const size_t funcs = header.root + 2 + count;
+                const uint32_t func_count = word(funcs);
+                for (uint32_t i = 0; i < func_count; i++) {
+                    prog.funcs.push_back(read_func(ref(funcs + 1 + i)));
+                }
+                if (header.version >= 4) {
+                    m_source = read_token(funcs + 1 + func_count).value;
+                }
+            }
+        }
+        catch (const std::bad_alloc&) {
+            error("more nodes than the file can hold");
+        }
+        return prog;
+    }
+
+    // The file the program was parsed from, as the compiler that wrote the AST was given it. Files
+    // written before version 4 do not record it.
+    [[nodiscard]] const std::optional<std::string>& source() const {
+        return m_source;
+    }
+
+private:
+    // Maps the file and returns its size.
+    size_t map(const std::string& path) {
+#ifndef _WIN32
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error("could not open file");
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            error("could not stat file");
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        if (m_size != 0) {
+            m_mapping_size = m_size;
+            m_mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m_mapping == MAP_FAILED) {
+                m_mapping = nullptr;
+                close(fd);
+                error("could not map file");
+            }
+            m_data = static_cast<const char*>(m_mapping);
+        }
+        close(fd);
+#else
+        // No mmap on Windows runtimes without pulling in <windows.h>, whose TokenType clashes with ours
+        std::ifstream input(path, std::ios::in | std::ios::binary);
+        if (!input) {
+            error("could not open file");
+        }
+        std::stringstream contents;
+        contents << input.rdbuf();
+        m_buffer = contents.str();
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#endif
+        return m_size;
+    }
+
+    [[noreturn]] void error(const std::string& msg) const {
+        std::cerr << "[AST Error] " << m_path << ": " << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    [[nodiscard]] uint32_t word(size_t pos) const {
+        if (pos >= m_word_count) {
+            error("record out of bounds");
+        }
+        return m_words[pos];
+    }
+
+    // Follows the node reference stored at pos. Children always precede their parents, which
+    // keeps a damaged file from sending the reader round in circles.
+    [[nodiscard]] size_t ref(size_t pos) const {
+        const int32_t offset = static_cast<int32_t>(word(pos));
+        if (offset >= 0 || static_cast<size_t>(-static_cast<int64_t>(offset)) > pos) {
+            error("bad reference");
+        }
+        return pos + offset;
+    }
+
+    [[nodiscard]] std::optional<size_t> optional_ref(size_t pos) const {
+        if (word(pos) == 0) {
+            return {};
+        }
+        return ref(pos);
+    }
+
+    // Marks the record at pos as read. The writer never shares a record between parents, so a
+    // record referenced twice is damage, and rejecting it keeps a file of back-references from
+    // expanding into exponentially many nodes.
+    void claim(size_t pos) {
+        if (pos >= m_word_count) {
+            error("record out of bounds");
+        }
+        if (m_read.at(pos)) {
+            error("record referenced twice");
+        }
+        m_read.at(pos) = true;
+    }
+
+    [[nodiscard]] AstKind kind(size_t pos) const {
+        return static_cast<AstKind>(word(pos));
+    }
+
+    void expect(size_t pos, AstKind expected) const {
+        if (kind(pos) != expected) {
+            error("unexpected record kind");
+        }
+    }
+
+    // Reads the three-word token at pos.
+    [[nodiscard]] Token read_token(size_t pos) const {
+        Token token {.type = static_cast<TokenType>(word(pos)), .line = static_cast<int>(word(pos + 1))};
+        if (const int32_t offset = static_cast<int32_t>(word(pos + 2)); offset != 0) {
+            if (offset < 0) {
+                error("bad string reference");
+            }
+            const size_t str = pos + 2 + offset;
+            const uint32_t length = word(str);
+            // In 64 bits, as a length near UINT32_MAX would wrap the rounding up to a small count
+            if ((uint64_t {length} + 3) / 4 > m_word_count - str - 1) {
+                error("string out of bounds");
+            }
+            token.value = std::string(reinterpret_cast<const char*>(m_words + str + 1), length);
+        }
+        return token;
+    }
+
+    NodeExpr* read_expr(size_t pos) {
+        claim(pos);
+        auto expr = m_allocator.alloc<NodeExpr>();
+        switch (kind(pos)) {
+            case AstKind::term_int_lit: {
+                auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
+                term_int_lit->int_lit = read_token(pos + 1);
+                auto term = m_allocator.alloc<NodeTerm>();
+                term->var = term_int_lit;
+                expr->var = term;
+                break;
+            }
+            case AstKind::term_ident: {
+                auto term_ident = m_allocator.alloc<NodeTermIdent>();
+                term_ident->ident = read_token(pos + 1);
+                auto term = m_allocator.alloc<NodeTerm>();
+                term->var = term_ident;
+                expr->var = term;
+                break;
+            }
+            case AstKind::term_paren: {
+                auto term_paren = m_allocator.alloc<NodeTermParen>();
+                term_paren->expr = read_expr(ref(pos + 1));
+                auto term = m_allocator.alloc<NodeTerm>();
+                term->var = term_paren;
+                expr->var = term;
+                break;
+            }
+            case AstKind::term_call: {
+                auto term_call = m_allocator.alloc<NodeTermCall>();
+                term_call->ident = read_token(pos + 1);
+                const uint32_t count = word(pos + 4);
+                for (uint32_t i = 0; i < count; i++) {
+                    term_call->args.push_back(read_expr(ref(pos + 5 + i)));
+                }
+                auto term = m_allocator.alloc<NodeTerm>();
+                term->var = term_call;
+                expr->var = term;
+                break;
+            }
+            case AstKind::bin_add:
+                expr->var = read_bin_expr<NodeBinExprAdd>(pos);
+                break;
+            case AstKind::bin_multi:
+                expr->var = read_bin_expr<NodeBinExprMulti>(pos);
+                break;
+            case AstKind::bin_sub:
+                expr->var = read_bin_expr<NodeBinExprSub>(pos);
+                break;
+            case AstKind::bin_div:
+                expr->var = read_bin_expr<NodeBinExprDiv>(pos);
+                break;
+            default:
+                error("expected expression record");
+        }
+        return expr;
+    }
+
+    template<typename T>
+    NodeBinExpr* read_bin_expr(size_t pos) {
+        auto node = m_allocator.alloc<T>();
+        node->lhs = read_expr(ref(pos + 1));
+        node->rhs = read_expr(ref(pos + 2));
+        auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+        bin_expr->var = node;
+        return bin_expr;
+    }
+
+    NodeFunc* read_func(size_t pos) {
+        claim(pos);
+        expect(pos, AstKind::func);
+        auto func = m_allocator.alloc<NodeFunc>();
+        func->line = static_cast<int>(word(pos + 1));
+        func->ident = read_token(pos + 2);
+        const uint32_t count = word(pos + 5);
+        for (uint32_t i = 0; i < count; i++) {
+            func->params.push_back(read_token(pos + 6 + 3 * i));
+        }
+        func->scope = read_scope(ref(pos + 6 + 3 * static_cast<size_t>(count)));
+        return func;
+    }
+
+    NodeScope* read_scope(size_t pos) {
+        claim(pos);
+        expect(pos, AstKind::scope);
+        auto scope = m_allocator.alloc<NodeScope>();
+        const uint32_t count = word(pos + 1);
+        for (uint32_t i = 0; i < count; i++) {
+            scope->stmts.push_back(read_stmt(ref(pos + 2 + i)));
+        }
+        return scope;
+    }
+
+    NodeIfPred* read_if_pred(size_t pos) {
+        claim(pos);
+        auto pred = m_allocator.alloc<NodeIfPred>();
+        if (kind(pos) == AstKind::pred_elif) {
+            auto elif = m_allocator.alloc<NodeIfPredElif>();
+            elif->line = static_cast<int>(word(pos + 1));
+            elif->expr = read_expr(ref(pos + 2));
+            elif->scope = read_scope(ref(pos + 3));
+            if (const auto next = optional_ref(pos + 4)) {
+                elif->pred = read_if_pred(next.value());
+            }
+            pred->var = elif;
+        }
+        else {
+            expect(pos, AstKind::pred_else);
+            auto else_ = m_allocator.alloc<NodeIfPredElse>();
+            else_->scope = read_scope(ref(pos + 1));
+            pred->var = else_;
+        }
+        return pred;
+    }
+
+    NodeStmt* read_stmt(size_t pos) {
+        claim(pos);
+        auto stmt = m_allocator.alloc<NodeStmt>();
+        stmt->line = static_cast<int>(word(pos + 1));
+        switch (kind(pos)) {
+            case AstKind::stmt_exit: {
+                auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
+                stmt_exit->expr = read_expr(ref(pos + 2));
+                stmt->var = stmt_exit;
+                break;
+            }
+            case AstKind::stmt_let: {
+                auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+                stmt_let->ident = read_token(pos + 2);
+                stmt_let->expr = read_expr(ref(pos + 5));
+                stmt->var = stmt_let;
+                break;
+            }
+            case AstKind::stmt_scope:
+                stmt->var = read_scope(ref(pos + 2));
+                break;
+            case AstKind::stmt_if: {
+                auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+                stmt_if->expr = read_expr(ref(pos + 2));
+                stmt_if->scope = read_scope(ref(pos + 3));
+                if (const auto pred = optional_ref(pos + 4)) {
+                    stmt_if->pred = read_if_pred(pred.value());
+                }
+                stmt->var = stmt_if;
+                break;
+            }
+            case AstKind::stmt_assign: {
+                auto stmt_assign = m_allocator.alloc<NodeStmtAssign>();
+                stmt_assign->ident = read_token(pos + 2);
+                stmt_assign->expr = read_expr(ref(pos + 5));
+                stmt->var = stmt_assign;
+                break;
+            }
+            case AstKind::stmt_while: {
+                auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
+                stmt_while->expr = read_expr(ref(pos + 2));
+                stmt_while->scope = read_scope(ref(pos + 3));
+                stmt->var = stmt_while;
+                break;
+            }
+            case AstKind::stmt_return: {
+                auto stmt_return = m_allocator.alloc<NodeStmtReturn>();
+                stmt_return->expr = read_expr(ref(pos + 2));
+                stmt->var = stmt_return;
+                break;
+            }
+            default:
+                error("expected statement record");
+        }
+        return stmt;
+    }
+
+    const std::string m_path;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    void* m_mapping = nullptr;
+    size_t m_mapping_size = 0;
+#ifdef _WIN32
+    std::string m_buffer;
+#endif
+    const uint32_t* m_words = nullptr;
+    size_t m_word_count = 0;
+    // Records already turned into nodes
+    std::vector<bool> m_read {};
+    std::optional<std::string> m_source {};
+    ArenaAllocator m_allocator;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "parser.hpp"
+
+// A profile holds one execution count per if/elif/else arm: the magic "RCPROF01", the
+// number of counters, then the counters, all little-endian 64-bit.
+constexpr std::string_view profile_magic = "RCPROF01";
+
+inline std::optional<std::vector<uint64_t>> read_profile(const std::string& path) {
+    std::ifstream input(path, std::ios::in | std::ios::binary);
+    std::string magic(profile_magic.size(), '\0');
+    uint64_t count = 0;
+    if (!input.read(magic.data(), static_cast<std::streamsize>(magic.size())) || magic != profile_magic) {
+        return {};
+    }
+    if (!input.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+        return {};
+    }
+    std::vector<uint64_t> counters(count);
+    if (!input.read(reinterpret_cast<char*>(counters.data()), static_cast<std::streamsize>(count * sizeof(uint64_t)))) {
+        return {};
+    }
+    return counters;
+}
+
+// Numbers the arms of every if/elif/else chain in source order, so an instrumented build and
+// a later build using its profile agree on counter indices whatever layout they pick.
+class ArmCounters {
+public:
+    inline explicit ArmCounters(const NodeProg& prog) {
+        for (const NodeStmt& stmt : prog.stmts) {
+            number_stmt(stmt);
+        }
+        for (const NodeFunc* func : prog.funcs) {
+            number_scope(func->scope);
+        }
+    }
+
+    // Each arm is identified by its scope.
+    [[nodiscard]] size_t index(const NodeScope* arm) const {
+        return m_indices.at(arm);
+    }
+
+    [[nodiscard]] size_t count() const {
+        return m_indices.size();
+    }
+
+private:
+    void number_scope(const NodeScope* scope) {
+        for (const NodeStmt* stmt : scope->stmts) {
+            number_stmt(*stmt);
+        }
+    }
+
+    void number_arm(const NodeScope* arm) {
+        m_indices[arm] = m_indices.size();
+        number_scope(arm);
+    }
+
+    void number_stmt(const NodeStmt& stmt) {
+        struct StmtVisitor {
+            ArmCounters& counters;
+            void operator()(const NodeStmtExit*) const {}
+            void operator()(const NodeStmtLet*) const {}
+            void operator()(const NodeScope* scope) const {
+                counters.number_scope(scope);
+            }
+            void operator()(const NodeStmtIf* stmt_if) const {
+                counters.number_arm(stmt_if->scope);
+                if (stmt_if->pred.has_value()) {
+                    counters.number_if_pred(stmt_if->pred.value());
+                }
+            }
+            void operator()(const NodeStmtAssign*) const {}
+            void operator()(const NodeStmtWhile* stmt_while) const {
+                counters.number_scope(stmt_while->scope);
+            }
+            void operator()(const NodeStmtReturn*) const {}
+        };
+        StmtVisitor visitor {.counters = *this};
+        std::visit(visitor, stmt.var);
+    }
+
+    void number_if_pred(const NodeIfPred* pred) {
+        struct PredVisitor {
+            ArmCounters& counters;
+            void operator()(const NodeIfPredElif* elif) const {
+                counters.number_arm(elif->scope);
+                if (elif->pred.has_value()) {
+                    counters.number_if_pred(elif->pred.value());
+                }
+            }
+            void operator()(const NodeIfPredElse* else_) const {
+                counters.number_arm(else_->scope);
+            }
+        };
+        PredVisitor visitor {.counters = *this};
+        std::visit(visitor, pred->var);
+    }
+
+    std::unordered_map<const NodeScope*, size_t> m_indices {};
+};
@@ -0,0 +1,512 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+#include "arena.hpp"
+#include "parser.hpp"
+#include "selection.hpp"
+
+// Value-range analysis. Every expression gets the interval of unsigned 64-bit values it can take,
+// flowing from literals through lets and assignments. Inside an if/elif arm a test on a variable
+// narrows it: `if (x)` has x nonzero in its arm and zero after, `if (x - c)` and `if (c - x)`
+// have x equal to c after. Variables a loop assigns can hold anything inside and after it, and
+// arms that end in exit or return do not flow into what follows. The ranges are then used to
+//   - remove if/elif/else arms whose pure test is never true, and the arms after one always true,
+//   - turn a division by a pure divisor that can only have one value into a division by that
+//     literal, which the selector emits as a shift or a multiplication, and fold a division whose
+//     quotient can only have one value,
+//   - mark additions, subtractions, multiplications and divisions whose operands and value fit in
+//     32 bits, which the selector then emits on 32-bit registers.
+// The language has no bitwise operators, so intervals capture about everything known bits would.
+//
+// The passes before this one keep the program a tree: the inliner clones an argument for each of
+// its uses and the reassociator rewrites nodes in place, so every expression node is met once.
+// Decisions are still made after the whole program has been analyzed, from the union of the
+// ranges recorded for a node, so that a node shared by a future pass is only rewritten in a way
+// that holds at all of its uses.
+class RangeAnalyzer {
+public:
+    struct Stats {
+        // Conditional branches removed with their tests
+        size_t branches = 0;
+        // div instructions replaced by a shift, a multiplication or a literal
+        size_t divisions = 0;
+        size_t narrowed = 0;
+    };
+
+    inline RangeAnalyzer()
+        : m_allocator(64 * 1024)
+    {}
+
+    inline RangeAnalyzer(const RangeAnalyzer& other) = delete;
+
+    inline RangeAnalyzer& operator=(const RangeAnalyzer& other) = delete;
+
+    // Analyzes prog and simplifies it in place. New nodes live in the analyzer's arena.
+    void run(NodeProg& prog) {
+        NodeScope top;
+        for (NodeStmt& stmt : prog.stmts) {
+            top.stmts.push_back(&stmt);
+        }
+        Env env;
+        analyze_scope(&top, env);
+        for (const NodeFunc* func : prog.funcs) {
+            Env frame;
+            for (const Token& param : func->params) {
+                frame.vars.push_back({.name = param.value.value(), .range = {}});
+            }
+            analyze_scope(func->scope, frame);
+        }
+        for_each_stmt(&top, [&](const NodeStmt& stmt) {
+            rewrite_stmt(const_cast<NodeStmt&>(stmt));
+        });
+        for (const NodeFunc* func : prog.funcs) {
+            for_each_stmt(func->scope, [&](const NodeStmt& stmt) {
+                rewrite_stmt(const_cast<NodeStmt&>(stmt));
+            });
+        }
+    }
+
+    [[nodiscard]] const Stats& stats() const {
+        return m_stats;
+    }
+
+    // Expressions whose operands and value fit in 32 bits.
+    [[nodiscard]] const std::unordered_set<const NodeExpr*>& narrow() const {
+        return m_narrow;
+    }
+
+private:
+    static constexpr uint64_t dword_max = std::numeric_limits<uint32_t>::max();
+
+    struct Range {
+        uint64_t lo = 0;
+        uint64_t hi = std::numeric_limits<uint64_t>::max();
+
+        [[nodiscard]] bool single() const {
+            return lo == hi;
+        }
+
+        [[nodiscard]] Range hull(const Range& other) const {
+            return {.lo = std::min(lo, other.lo), .hi = std::max(hi, other.hi)};
+        }
+    };
+
+    struct Var {
+        std::string name;
+        Range range;
+    };
+
+    // What is known at one point of a function: the ranges of the variables in scope, innermost
+    // last, or that the point cannot be reached.
+    struct Env {
+        std::vector<Var> vars {};
+        bool reachable = true;
+
+        Var* find(const std::string& name) {
+            for (auto it = vars.rbegin(); it != vars.rend(); ++it) {
+                if (it->name == name) {
+                    return &*it;
+                }
+            }
+            return nullptr;
+        }
+
+        // Environments at the ends of different paths from the same point, with the same variables.
+        void join(const Env& other) {
+            if (!other.reachable) {
+                return;
+            }
+            if (!reachable) {
+                *this = other;
+                return;
+            }
+            for (size_t i = 0; i < vars.size(); i++) {
+                vars.at(i).range = vars.at(i).range.hull(other.vars.at(i).range);
+            }
+        }
+    };
+
+    struct IfArm {
+        NodeExpr* test; // nullptr for else
+        NodeScope* scope;
+        int line;
+    };
+
+    static Range add(const Range& a, const Range& b) {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+        if (__builtin_add_overflow(a.hi, b.hi, &hi)) {
+            return {};
+        }
+        __builtin_add_overflow(a.lo, b.lo, &lo);
+        return {.lo = lo, .hi = hi};
+    }
+
+    static Range sub(const Range& a, const Range& b) {
+        if (a.lo < b.hi) {
+            return {};
+        }
+        return {.lo = a.lo - b.hi, .hi = a.hi - b.lo};
+    }
+
+    static Range mul(const Range& a, const Range& b) {
+        uint64_t hi = 0;
+        if (__builtin_mul_overflow(a.hi, b.hi, &hi)) {
+            return {};
+        }
+        return {.lo = a.lo * b.lo, .hi = hi};
+    }
+
+    // A zero divisor traps, so only the nonzero part of the divisor's range matters.
+    static Range div(const Range& a, const Range& b) {
+        if (b.hi == 0) {
+            return {};
+        }
+        return {.lo = a.lo / b.hi, .hi = a.hi / std::max<uint64_t>(b.lo, 1)};
+    }
+
+    static const NodeTermIdent* ident(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+        if (term == nullptr) {
+            return nullptr;
+        }
+        const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+        return term_ident == nullptr ? nullptr : *term_ident;
+    }
+
+    static std::vector<IfArm> if_arms(const NodeStmtIf* stmt_if) {
+        std::vector<IfArm> arms {{.test = stmt_if->expr, .scope = stmt_if->scope, .line = 0}};
+        std::optional<NodeIfPred*> pred = stmt_if->pred;
+        while (pred.has_value()) {
+            if (const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var)) {
+                arms.push_back({.test = (*elif)->expr, .scope = (*elif)->scope, .line = (*elif)->line});
+                pred = (*elif)->pred;
+            }
+            else {
+                arms.push_back({.test = nullptr, .scope = std::get<NodeIfPredElse*>(pred.value()->var)->scope, .line = 0});
+                pred = {};
+            }
+        }
+        return arms;
+    }
+
+    // The range of expr in env, recorded for expr and every expression below it.
+    Range analyze_expr(const NodeExpr* expr, Env& env) {
+        Range range;
+        if (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto value = int_lit_value(expr)) {
+                range = {.lo = value.value(), .hi = value.value()};
+            }
+            else if (const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var)) {
+                if (const Var* var = env.find((*term_ident)->ident.value.value())) {
+                    range = var->range;
+                }
+            }
+            else if (const auto paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                range = analyze_expr((*paren)->expr, env);
+            }
+            else if (const auto call = std::get_if<NodeTermCall*>(&(*term)->var)) {
+                for (const NodeExpr* arg : (*call)->args) {
+                    analyze_expr(arg, env);
+                }
+            }
+        }
+        else {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+            range = std::visit([&](const auto* bin) {
+                const Range lhs = analyze_expr(bin->lhs, env);
+                const Range rhs = analyze_expr(bin->rhs, env);
+                using Bin = std::remove_cvref_t<decltype(*bin)>;
+                if constexpr (std::is_same_v<Bin, NodeBinExprAdd>) {
+                    return add(lhs, rhs);
+                }
+                else if constexpr (std::is_same_v<Bin, NodeBinExprSub>) {
+                    return sub(lhs, rhs);
+                }
+                else if constexpr (std::is_same_v<Bin, NodeBinExprMulti>) {
+                    return mul(lhs, rhs);
+                }
+                else {
+                    return div(lhs, rhs);
+                }
+            }, bin_expr->var);
+        }
+        const auto [it, inserted] = m_ranges.try_emplace(expr, range);
+        if (!inserted) {
+            it->second = it->second.hull(range);
+        }
+        return range;
+    }
+
+    // Narrows env to the paths where test is nonzero (taken) or zero.
+    static void refine(Env& env, const NodeExpr* test, const Range& range, bool taken) {
+        if (taken ? range.hi == 0 : range.lo != 0) {
+            env.reachable = false;
+            return;
+        }
+        Var* var = nullptr;
+        uint64_t zero_at = 0;
+        if (const NodeTermIdent* term_ident = ident(test)) {
+            var = env.find(term_ident->ident.value.value());
+        }
+        else if (const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(test)->var)) {
+            if (const auto sub = std::get_if<NodeBinExprSub*>(&(*bin_expr)->var)) {
+                // x - c and c - x are zero exactly when x is c
+                const bool lit_first = int_lit_value((*sub)->lhs).has_value();
+                const NodeTermIdent* term_ident = ident(lit_first ? (*sub)->rhs : (*sub)->lhs);
+                const std::optional<uint64_t> value = int_lit_value(lit_first ? (*sub)->lhs : (*sub)->rhs);
+                if (term_ident != nullptr && value.has_value()) {
+                    var = env.find(term_ident->ident.value.value());
+                    zero_at = value.value();
+                }
+            }
+        }
+        if (var == nullptr) {
+            return;
+        }
+        Range& r = var->range;
+        if (!taken) {
+            r = {.lo = zero_at, .hi = zero_at};
+        }
+        else if (r.lo == zero_at) {
+            r.lo++;
+        }
+        else if (r.hi == zero_at) {
+            r.hi--;
+        }
+    }
+
+    void analyze_scope(const NodeScope* scope, Env& env) {
+        const size_t vars = env.vars.size();
+        for (const NodeStmt* stmt : scope->stmts) {
+            analyze_stmt(*stmt, env);
+        }
+        env.vars.resize(vars);
+    }
+
+    void analyze_stmt(const NodeStmt& stmt, Env& env) {
+        if (!env.reachable) {
+            return;
+        }
+        if (const auto stmt_exit = std::get_if<NodeStmtExit*>(&stmt.var)) {
+            analyze_expr((*stmt_exit)->expr, env);
+            env.reachable = false;
+        }
+        else if (const auto stmt_return = std::get_if<NodeStmtReturn*>(&stmt.var)) {
+            analyze_expr((*stmt_return)->expr, env);
+            env.reachable = false;
+        }
+        else if (const auto stmt_let = std::get_if<NodeStmtLet*>(&stmt.var)) {
+            const Range range = analyze_expr((*stmt_let)->expr, env);
+            env.vars.push_back({.name = (*stmt_let)->ident.value.value(), .range = range});
+        }
+        else if (const auto stmt_assign = std::get_if<NodeStmtAssign*>(&stmt.var)) {
+            const Range range = analyze_expr((*stmt_assign)->expr, env);
+            if (Var* var = env.find((*stmt_assign)->ident.value.value())) {
+                var->range = range;
+            }
+        }
+        else if (const auto scope = std::get_if<NodeScope*>(&stmt.var)) {
+            analyze_scope(*scope, env);
+        }
+        else if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt.var)) {
+            analyze_if(*stmt_if, env);
+        }
+        else {
+            analyze_while(std::get<NodeStmtWhile*>(stmt.var), env);
+        }
+    }
+
+    void analyze_if(const NodeStmtIf* stmt_if, Env& env) {
+        Env after {.vars = env.vars, .reachable = false};
+        for (const IfArm& arm : if_arms(stmt_if)) {
+            if (!env.reachable) {
+                break;
+            }
+            if (arm.test == nullptr) {
+                analyze_scope(arm.scope, env);
+                after.join(env);
+                env.reachable = false;
+                break;
+            }
+            const Range range = analyze_expr(arm.test, env);
+            Env taken = env;
+            refine(taken, arm.test, range, true);
+            if (taken.reachable) {
+                analyze_scope(arm.scope, taken);
+                after.join(taken);
+            }
+            refine(env, arm.test, range, false);
+        }
+        after.join(env);
+        env = after;
+    }
+
+    // Analyzes the loop once, with every variable it assigns free to hold anything.
+    void analyze_while(const NodeStmtWhile* stmt_while, Env& env) {
+        for_each_stmt(stmt_while->scope, [&](const NodeStmt& stmt) {
+            if (const auto stmt_assign = std::get_if<NodeStmtAssign*>(&stmt.var)) {
+                if (Var* var = env.find((*stmt_assign)->ident.value.value())) {
+                    var->range = {};
+                }
+            }
+        });
+        const Range range = analyze_expr(stmt_while->expr, env);
+        Env body = env;
+        refine(body, stmt_while->expr, range, true);
+        if (body.reachable) {
+            analyze_scope(stmt_while->scope, body);
+        }
+        refine(env, stmt_while->expr, range, false);
+    }
+
+    [[nodiscard]] std::optional<Range> recorded(const NodeExpr* expr) const {
+        const auto it = m_ranges.find(expr);
+        if (it == m_ranges.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+    void rewrite_stmt(NodeStmt& stmt) {
+        if (const auto stmt_if = std::get_if<NodeStmtIf*>(&stmt.var)) {
+            rewrite_if(stmt, *stmt_if);
+        }
+        for (const NodeExpr* expr : stmt_exprs(stmt)) {
+            for_each_subexpr(expr, [&](const NodeExpr* sub) {
+                rewrite_expr(const_cast<NodeExpr*>(sub));
+            });
+        }
+    }
+
+    // Drops the arms whose pure test is never true and turns an arm whose pure test is always true
+    // into the else, dropping the arms after it.
+    void rewrite_if(NodeStmt& stmt, const NodeStmtIf* stmt_if) {
+        const std::vector<IfArm> arms = if_arms(stmt_if);
+        std::vector<IfArm> kept;
+        for (size_t i = 0; i < arms.size(); i++) {
+            const IfArm& arm = arms.at(i);
+            const std::optional<Range> range = arm.test == nullptr ? std::nullopt : recorded(arm.test);
+            if (!range.has_value() || !is_pure(arm.test)) {
+                kept.push_back(arm);
+                continue;
+            }
+            if (range.value().hi == 0) {
+                m_stats.branches++;
+                continue;
+            }
+            if (range.value().lo != 0) {
+                kept.push_back({.test = nullptr, .scope = arm.scope, .line = arm.line});
+                for (size_t j = i; j < arms.size(); j++) {
+                    if (arms.at(j).test != nullptr) {
+                        m_stats.branches++;
+                    }
+                }
+                break;
+            }
+            kept.push_back(arm);
+        }
+        if (kept.size() == arms.size() && kept.back().test == arms.back().test) {
+            return;
+        }
+        if (kept.empty()) {
+            stmt.var = m_allocator.alloc<NodeScope>();
+            return;
+        }
+        if (kept.front().test == nullptr) {
+            stmt.var = kept.front().scope;
+            return;
+        }
+        auto head = m_allocator.alloc<NodeStmtIf>();
+        head->expr = kept.front().test;
+        head->scope = kept.front().scope;
+        if (kept.front().line != 0) {
+            stmt.line = kept.front().line;
+        }
+        std::optional<NodeIfPred*>* link = &head->pred;
+        for (size_t i = 1; i < kept.size(); i++) {
+            auto pred = m_allocator.alloc<NodeIfPred>();
+            if (kept.at(i).test == nullptr) {
+                auto stmt_else = m_allocator.alloc<NodeIfPredElse>();
+                stmt_else->scope = kept.at(i).scope;
+                pred->var = stmt_else;
+                *link = pred;
+                break;
+            }
+            auto elif = m_allocator.alloc<NodeIfPredElif>();
+            elif->line = kept.at(i).line;
+            elif->expr = kept.at(i).test;
+            elif->scope = kept.at(i).scope;
+            pred->var = elif;
+            *link = pred;
+            link = &elif->pred;
+        }
+        stmt.var = head;
+    }
+
+    void rewrite_expr(NodeExpr* expr) {
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var);
+        const std::optional<Range> range = recorded(expr);
+        if (bin_expr == nullptr || !range.has_value()) {
+            return;
+        }
+        if (const auto div = std::get_if<NodeBinExprDiv*>(&(*bin_expr)->var)) {
+            const bool divides = emits_div((*div)->rhs);
+            const std::optional<Range> divisor = recorded((*div)->rhs);
+            if (divisor.has_value() && divisor.value().single() && divisor.value().lo != 0
+                && !int_lit_value((*div)->rhs).has_value() && is_pure((*div)->rhs)) {
+                (*div)->rhs = literal(divisor.value().lo);
+                m_ranges[(*div)->rhs] = divisor.value();
+            }
+            if (range.value().single() && is_pure(expr)) {
+                expr->var = literal(range.value().lo)->var;
+                if (divides) {
+                    m_stats.divisions++;
+                }
+                return;
+            }
+            if (divides && !emits_div((*div)->rhs)) {
+                m_stats.divisions++;
+            }
+        }
+        const std::optional<Range> lhs = std::visit([&](const auto* bin) { return recorded(bin->lhs); }, (*bin_expr)->var);
+        const std::optional<Range> rhs = std::visit([&](const auto* bin) { return recorded(bin->rhs); }, (*bin_expr)->var);
+        if (lhs.has_value() && rhs.has_value() && lhs.value().hi <= dword_max && rhs.value().hi <= dword_max
+            && range.value().hi <= dword_max) {
+            m_narrow.insert(expr);
+            m_stats.narrowed++;
+        }
+    }
+
+    // Whether the selector needs a div instruction to divide by divisor.
+    static bool emits_div(const NodeExpr* divisor) {
+        const std::optional<uint64_t> value = int_lit_value(divisor);
+        return !value.has_value() || !(std::has_single_bit(value.value()) || magic_divisor(value.value()).has_value());
+    }
+
+    NodeExpr* literal(uint64_t value) {
+        auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+        int_lit->int_lit = {.type = TokenType::int_lit, .line = 0, .value = std::to_string(value)};
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = int_lit;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = term;
+        return expr;
+    }
+
+    ArenaAllocator m_allocator;
+    std::unordered_map<const NodeExpr*, Range> m_ranges {};
+    std::unordered_set<const NodeExpr*> m_narrow {};
+    Stats m_stats {};
+};
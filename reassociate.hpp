@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "arena.hpp"
+#include "parser.hpp"
+
+// Rebuilds chains of additions and of multiplications as balanced trees. The parser nests
+// `a + b + c + d` to the left, so every addition waits for the one before it; as
+// `(a + b) + (c + d)` the selector evaluates the halves into different registers and the two
+// inner additions can execute in parallel, cutting the dependency chain of n operands from n - 1
+// operations to about log2(n).
+//
+// Wrapping arithmetic modulo 2^64 is associative and commutative for both operators, so any
+// grouping computes the same value. The operands keep their order, except that literals are folded
+// into one that goes last, where it becomes an immediate. Chains with an impure operand are left
+// alone, since a different grouping may evaluate their operands in a different order.
+class Reassociator {
+public:
+    struct Stats {
+        size_t chains = 0;
+        // Longest chain of dependent operations over all rebuilt expressions
+        size_t depth_before = 0;
+        size_t depth_after = 0;
+    };
+
+    inline Reassociator()
+        : m_allocator(1024 * 1024)
+    {}
+
+    inline Reassociator(const Reassociator& other) = delete;
+
+    inline Reassociator& operator=(const Reassociator& other) = delete;
+
+    // Rebalances every expression of prog in place. New nodes live in the reassociator's arena.
+    void run(NodeProg& prog) {
+        NodeScope top;
+        for (NodeStmt& stmt : prog.stmts) {
+            top.stmts.push_back(&stmt);
+        }
+        for_each_stmt(&top, [&](const NodeStmt& stmt) {
+            rewrite_stmt(stmt);
+        });
+        for (const NodeFunc* func : prog.funcs) {
+            for_each_stmt(func->scope, [&](const NodeStmt& stmt) {
+                rewrite_stmt(stmt);
+            });
+        }
+    }
+
+    [[nodiscard]] const Stats& stats() const {
+        return m_stats;
+    }
+
+private:
+    void rewrite_stmt(const NodeStmt& stmt) {
+        struct StmtVisitor {
+            Reassociator& reassociator;
+            void operator()(NodeStmtExit* stmt_exit) const {
+                stmt_exit->expr = reassociator.balance(stmt_exit->expr);
+            }
+            void operator()(NodeStmtLet* stmt_let) const {
+                stmt_let->expr = reassociator.balance(stmt_let->expr);
+            }
+            void operator()(NodeScope*) const {}
+            void operator()(NodeStmtIf* stmt_if) const {
+                stmt_if->expr = reassociator.balance(stmt_if->expr);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    const auto elif = std::get_if<NodeIfPredElif*>(&pred.value()->var);
+                    if (elif == nullptr) {
+                        break;
+                    }
+                    (*elif)->expr = reassociator.balance((*elif)->expr);
+                    pred = (*elif)->pred;
+                }
+            }
+            void operator()(NodeStmtAssign* stmt_assign) const {
+                stmt_assign->expr = reassociator.balance(stmt_assign->expr);
+            }
+            void operator()(NodeStmtWhile* stmt_while) const {
+                stmt_while->expr = reassociator.balance(stmt_while->expr);
+            }
+            void operator()(NodeStmtReturn* stmt_return) const {
+                stmt_return->expr = reassociator.balance(stmt_return->expr);
+            }
+        };
+        std::visit(StmtVisitor {.reassociator = *this}, stmt.var);
+    }
+
+    static NodeExpr* strip_parens(NodeExpr* expr) {
+        return const_cast<NodeExpr*>(unwrap_parens(expr));
+    }
+
+    static size_t depth(const NodeExpr* expr) {
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(expr)->var);
+        if (bin_expr == nullptr) {
+            return 0;
+        }
+        return std::visit([](const auto* bin) {
+            return 1 + std::max(depth(bin->lhs), depth(bin->rhs));
+        }, (*bin_expr)->var);
+    }
+
+    // Appends the operands of the chain of Op rooted at expr, looking through parentheses.
+    template<typename Op>
+    static void flatten(NodeExpr* expr, std::vector<NodeExpr*>& operands) {
+        expr = strip_parens(expr);
+        if (const auto bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+            if (const auto op = std::get_if<Op*>(&(*bin_expr)->var)) {
+                flatten<Op>((*op)->lhs, operands);
+                flatten<Op>((*op)->rhs, operands);
+                return;
+            }
+        }
+        operands.push_back(expr);
+    }
+
+    // Returns expr with its chains rebalanced, rewriting the operands of other operators in place.
+    NodeExpr* balance(NodeExpr* expr) {
+        if (const auto term = std::get_if<NodeTerm*>(&expr->var)) {
+            if (const auto paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+                (*paren)->expr = balance((*paren)->expr);
+            }
+            else if (const auto call = std::get_if<NodeTermCall*>(&(*term)->var)) {
+                for (NodeExpr*& arg : (*call)->args) {
+                    arg = balance(arg);
+                }
+            }
+            return expr;
+        }
+        NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        if (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) {
+            return balance_chain<NodeBinExprAdd>(expr);
+        }
+        if (std::holds_alternative<NodeBinExprMulti*>(bin_expr->var)) {
+            return balance_chain<NodeBinExprMulti>(expr);
+        }
+        std::visit([&](auto* bin) {
+            bin->lhs = balance(bin->lhs);
+            bin->rhs = balance(bin->rhs);
+        }, bin_expr->var);
+        return expr;
+    }
+
+    template<typename Op>
+    NodeExpr* balance_chain(NodeExpr* expr) {
+        constexpr bool add = std::is_same_v<Op, NodeBinExprAdd>;
+        std::vector<NodeExpr*> operands;
+        flatten<Op>(expr, operands);
+        const bool pure = std::ranges::all_of(operands, [](const NodeExpr* operand) {
+            return is_pure(operand);
+        });
+        uint64_t folded = add ? 0 : 1;
+        size_t literals = 0;
+        for (const NodeExpr* operand : operands) {
+            if (const std::optional<uint64_t> value = int_lit_value(operand)) {
+                folded = add ? folded + value.value() : folded * value.value();
+                literals++;
+            }
+        }
+        const bool keep_literal = literals > 0 && (literals == operands.size() || folded != (add ? 0 : 1));
+        const size_t count = operands.size() - literals + (keep_literal ? 1 : 0);
+        // A balanced tree of count operands is bit_width(count - 1) operations deep
+        if (!pure || (literals < 2 && static_cast<size_t>(std::bit_width(count - 1)) >= chain_depth<Op>(expr))) {
+            balance_operands<Op>(strip_parens(expr));
+            return expr;
+        }
+        const size_t before = depth(expr);
+        std::vector<NodeExpr*> kept;
+        for (NodeExpr* operand : operands) {
+            if (!int_lit_value(operand).has_value()) {
+                kept.push_back(balance(operand));
+            }
+        }
+        if (keep_literal) {
+            kept.push_back(literal(folded));
+        }
+        NodeExpr* balanced = build<Op>(kept);
+        m_stats.chains++;
+        m_stats.depth_before = std::max(m_stats.depth_before, before);
+        m_stats.depth_after = std::max(m_stats.depth_after, depth(balanced));
+        return balanced;
+    }
+
+    // Operations of the chain of Op rooted at expr on its longest path, not counting its operands'.
+    template<typename Op>
+    static size_t chain_depth(const NodeExpr* expr) {
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(expr)->var);
+        if (bin_expr == nullptr || !std::holds_alternative<Op*>((*bin_expr)->var)) {
+            return 0;
+        }
+        const Op* op = std::get<Op*>((*bin_expr)->var);
+        return 1 + std::max(chain_depth<Op>(op->lhs), chain_depth<Op>(op->rhs));
+    }
+
+    // Rebalances the operands of the chain of Op rooted at expr but keeps the chain's own shape.
+    template<typename Op>
+    void balance_operands(NodeExpr* expr) {
+        Op* op = std::get<Op*>(std::get<NodeBinExpr*>(expr->var)->var);
+        for (NodeExpr** side : {&op->lhs, &op->rhs}) {
+            NodeExpr* inner = strip_parens(*side);
+            const auto bin_expr = std::get_if<NodeBinExpr*>(&inner->var);
+            if (bin_expr != nullptr && std::holds_alternative<Op*>((*bin_expr)->var)) {
+                balance_operands<Op>(inner);
+            }
+            else {
+                *side = balance(*side);
+            }
+        }
+    }
+
+    // Groups operands into a balanced tree, the larger half on the left.
+    template<typename Op>
+    NodeExpr* build(std::span<NodeExpr* const> operands) {
+        if (operands.size() == 1) {
+            return operands.front();
+        }
+        const size_t half = (operands.size() + 1) / 2;
+        return bin<Op>(build<Op>(operands.first(half)), build<Op>(operands.subspan(half)));
+    }
+
+    template<typename Op>
+    NodeExpr* bin(NodeExpr* lhs, NodeExpr* rhs) {
+        auto op = m_allocator.alloc<Op>();
+        op->lhs = lhs;
+        op->rhs = rhs;
+        auto bin_expr = m_allocator.alloc<NodeBinExpr>();
+        bin_expr->var = op;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = bin_expr;
+        return expr;
+    }
+
+    NodeExpr* literal(uint64_t value) {
+        auto int_lit = m_allocator.alloc<NodeTermIntLit>();
+        int_lit->int_lit = {.type = TokenType::int_lit, .line = 0, .value = std::to_string(value)};
+        auto term = m_allocator.alloc<NodeTerm>();
+        term->var = int_lit;
+        auto expr = m_allocator.alloc<NodeExpr>();
+        expr->var = term;
+        return expr;
+    }
+
+    ArenaAllocator m_allocator;
+    Stats m_stats {};
+};
@@ -0,0 +1,762 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "parser.hpp"
+
+// Bottom-up tree pattern instruction selection (BURS style) for expressions.
+// label() finds, for every node and nonterminal, the cheapest rule deriving it;
+// reduce_*() then walks the chosen rules from the root and emits the code.
+
+enum class Nt {
+    reg,        // value in a register
+    imm,        // sign-extendable 32-bit immediate
+    mem,        // variable slot or pinned register usable as an r/m operand
+    index,      // reg * {1, 2, 4, 8}
+    base_index, // reg + reg * {1, 2, 4, 8}
+    addr,       // base_index or reg, plus an optional displacement
+};
+constexpr size_t nt_count = 6;
+
+enum class Rule {
+    none,
+    imm_int_lit,   // imm        <- IntLit
+    mem_ident,     // mem        <- Ident
+    mem_pinned,    // mem        <- any expression pinned to a register
+    reg_int_lit,   // reg        <- IntLit                      mov r, imm64
+    reg_imm,       // reg        <- imm                         mov r, imm
+    reg_mem,       // reg        <- mem                         mov r, m
+    reg_addr,      // reg        <- addr                        lea r, [addr]
+    index_reg,     // index      <- reg
+    index_mul,     // index      <- Mul(reg, 1|2|4|8)
+    bi_add,        // base_index <- Add(reg, index)
+    bi_mul,        // base_index <- Mul(reg, 3|5|9)
+    addr_bi,       // addr       <- base_index
+    addr_bi_disp,  // addr       <- Add(base_index, imm)
+    addr_reg_disp, // addr       <- Add(reg, imm)
+    add_reg_imm,   // reg        <- Add(reg, imm)               add r, imm
+    add_reg_mem,   // reg        <- Add(reg, mem)               add r, m
+    add_reg_reg,   // reg        <- Add(reg, reg)               add r, r
+    sub_reg_imm,   // reg        <- Sub(reg, imm)               sub r, imm
+    sub_reg_mem,   // reg        <- Sub(reg, mem)               sub r, m
+    sub_reg_reg,   // reg        <- Sub(reg, reg)               sub r, r
+    mul_shift,     // reg        <- Mul(reg, 2^k)               shl r, k
+    mul_mem_imm,   // reg        <- Mul(mem, imm)               imul r, m, imm
+    mul_reg_imm,   // reg        <- Mul(reg, imm)               imul r, r, imm
+    mul_reg_mem,   // reg        <- Mul(reg, mem)               imul r, m
+    mul_reg_reg,   // reg        <- Mul(reg, reg)               imul r, r
+    div_shift,     // reg        <- Div(reg, 2^k)               shr r, k
+    div_magic,     // reg        <- Div(reg, const)             mul by reciprocal
+    div_reg_mem,   // reg        <- Div(reg, mem)               div m
+    div_reg_reg,   // reg        <- Div(reg, reg)               div r
+    reg_call,      // reg        <- Call(reg...)                call f
+    count,
+};
+
+// Estimated cycles per rule, not counting the cost of its operands.
+constexpr std::array<int, static_cast<size_t>(Rule::count)> rule_costs {
+    0,  // none
+    0,  // imm_int_lit
+    0,  // mem_ident
+    0,  // mem_pinned
+    1,  // reg_int_lit
+    1,  // reg_imm
+    1,  // reg_mem
+    1,  // reg_addr
+    0,  // index_reg
+    0,  // index_mul
+    0,  // bi_add
+    0,  // bi_mul
+    0,  // addr_bi
+    0,  // addr_bi_disp
+    0,  // addr_reg_disp
+    1,  // add_reg_imm
+    1,  // add_reg_mem
+    1,  // add_reg_reg
+    1,  // sub_reg_imm
+    1,  // sub_reg_mem
+    1,  // sub_reg_reg
+    1,  // mul_shift
+    3,  // mul_mem_imm
+    3,  // mul_reg_imm
+    3,  // mul_reg_mem
+    3,  // mul_reg_reg
+    1,  // div_shift
+    6,  // div_magic
+    26, // div_reg_mem
+    26, // div_reg_reg
+    10, // reg_call
+};
+
+inline int rule_cost(Rule rule) {
+    return rule_costs.at(static_cast<size_t>(rule));
+}
+
+// Multiplier and shift replacing an unsigned 64-bit division by a constant (Granlund-Montgomery).
+// Without `add` the quotient is mulhi(n, multiplier) >> shift, otherwise
+// t = mulhi(n, multiplier), quotient = (((n - t) >> 1) + t) >> shift.
+struct MagicDivisor {
+    uint64_t multiplier;
+    int shift;
+    bool add;
+};
+
+inline std::optional<MagicDivisor> magic_divisor(uint64_t d) {
+    using u128 = unsigned __int128;
+    if (d < 3 || std::has_single_bit(d) || d > (1ull << 63)) {
+        return {};
+    }
+    const int l = 64 - std::countl_zero(d - 1);
+    for (int s = 0; s <= l; s++) {
+        const u128 pow = static_cast<u128>(1) << (64 + s);
+        const u128 m = pow / d + 1;
+        if (m <= std::numeric_limits<uint64_t>::max() && m * d - pow <= static_cast<u128>(1) << s) {
+            return MagicDivisor {.multiplier = static_cast<uint64_t>(m), .shift = s, .add = false};
+        }
+    }
+    const u128 m = (static_cast<u128>(1) << 64) * ((static_cast<u128>(1) << l) - d) / d + 1;
+    return MagicDivisor {.multiplier = static_cast<uint64_t>(m), .shift = l - 1, .add = true};
+}
+
+// Calling convention, System V style: the first six arguments in rdi, rsi, rdx, rcx, r8 and r9,
+// the rest pushed right to left and removed by the caller, the result in rax. rbx and r12-r15
+// are preserved by the callee, every other register may be clobbered.
+constexpr std::array<std::string_view, 6> arg_regs {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+inline bool is_callee_saved(std::string_view reg) {
+    return reg == "rbx" || reg == "r12" || reg == "r13" || reg == "r14" || reg == "r15";
+}
+
+// The low 32 bits of a 64-bit general purpose register. Writing them zeroes the upper half.
+inline std::optional<std::string_view> reg32(std::string_view reg64) {
+    static constexpr std::array<std::pair<std::string_view, std::string_view>, 15> regs {{
+        {"rax", "eax"}, {"rbx", "ebx"}, {"rcx", "ecx"}, {"rdx", "edx"},
+        {"rsi", "esi"}, {"rdi", "edi"}, {"rbp", "ebp"},
+        {"r8", "r8d"}, {"r9", "r9d"}, {"r10", "r10d"}, {"r11", "r11d"},
+        {"r12", "r12d"}, {"r13", "r13d"}, {"r14", "r14d"}, {"r15", "r15d"},
+    }};
+    for (const auto& [wide, narrow] : regs) {
+        if (wide == reg64) {
+            return narrow;
+        }
+    }
+    return {};
+}
+
+inline std::string func_label(const std::string& name) {
+    return "fn_" + name;
+}
+
+class Selector {
+public:
+    struct Stats {
+        size_t selected = 0;
+        size_t naive = 0;
+    };
+
+    // var_operand returns the memory operand of a variable at the current stack depth,
+    // push and pop spill registers through the generator's stack bookkeeping.
+    inline Selector(
+        std::stringstream& output,
+        std::function<std::string(const Token&)> var_operand,
+        std::function<void(const std::string&)> push,
+        std::function<void(const std::string&)> pop)
+        : m_output(output)
+        , m_var_operand(std::move(var_operand))
+        , m_push(std::move(push))
+        , m_pop(std::move(pop))
+    {}
+
+    // Evaluates expr and returns the register holding its value.
+    std::string select(const NodeExpr* expr) {
+        m_states.clear();
+        label(expr);
+        m_stats.naive += naive_count(expr) + 1;
+        const std::string dst = take();
+        reduce_reg(expr, dst);
+        release(dst);
+        return dst;
+    }
+
+    [[nodiscard]] const Stats& stats() const {
+        return m_stats;
+    }
+
+    // Takes a register out of the pool for the generator to keep a value in, or returns nothing
+    // if that would leave fewer than min_temps registers for evaluating expressions. Callee-saved
+    // registers come first, so the value survives calls.
+    std::optional<std::string> reserve() {
+        if (m_free.size() <= min_temps) {
+            return {};
+        }
+        std::string reg = m_free.front();
+        m_free.erase(m_free.begin());
+        m_touched.insert(reg);
+        return reg;
+    }
+
+    // Takes reg out of the pool if it is free and enough registers remain.
+    bool reserve(const std::string& reg) {
+        const auto it = std::ranges::find(m_free, reg);
+        if (it == m_free.end() || m_free.size() <= min_temps) {
+            return false;
+        }
+        m_free.erase(it);
+        m_touched.insert(reg);
+        return true;
+    }
+
+    // Returns a reserved register to its place in the pool.
+    void unreserve(const std::string& reg) {
+        const auto it = std::ranges::find_if(m_free, [&](const std::string& free) {
+            return pool_rank(free) > pool_rank(reg);
+        });
+        m_free.insert(it, reg);
+    }
+
+    // Registers taken from the pool since the last call, which a function has to preserve if
+    // they are callee-saved.
+    std::unordered_set<std::string> take_touched() {
+        return std::exchange(m_touched, {});
+    }
+
+    // Until unpinned, expr is not evaluated but read from reg, which the caller keeps up to date.
+    void pin(const NodeExpr* expr, const std::string& reg) {
+        m_pinned[unwrap_parens(expr)] = reg;
+    }
+
+    void unpin(const NodeExpr* expr) {
+        m_pinned.erase(unwrap_parens(expr));
+    }
+
+    [[nodiscard]] bool is_pinned(const NodeExpr* expr) const {
+        return m_pinned.contains(unwrap_parens(expr));
+    }
+
+    // expr, its operands and its value are known to fit in 32 bits, so its add, sub, imul or div
+    // can use 32-bit operands: shorter, and for div much faster.
+    void narrow(const NodeExpr* expr) {
+        m_narrow.insert(unwrap_parens(expr));
+    }
+
+private:
+    struct Choice {
+        int cost = infinite;
+        Rule rule = Rule::none;
+        bool swapped = false;
+    };
+    using State = std::array<Choice, nt_count>;
+
+    enum class Op { add, sub, mul, div };
+
+    struct Binary {
+        Op op;
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+    };
+
+    static constexpr int infinite = 1 << 24;
+    static constexpr size_t min_temps = 4;
+    // Allocated from the back, reserved from the front
+    static constexpr std::array<std::string_view, 12> pool {
+        "r15", "r14", "r13", "r12", "rbx", "r11", "r10", "r9", "r8", "rdi", "rsi", "rcx",
+    };
+
+    static size_t pool_rank(std::string_view reg) {
+        return std::ranges::find(pool, reg) - pool.begin();
+    }
+
+    static std::optional<Binary> as_binary(const NodeExpr* expr) {
+        struct BinExprVisitor {
+            Binary operator()(const NodeBinExprAdd* add) const {
+                return {Op::add, add->lhs, add->rhs};
+            }
+            Binary operator()(const NodeBinExprMulti* multi) const {
+                return {Op::mul, multi->lhs, multi->rhs};
+            }
+            Binary operator()(const NodeBinExprSub* sub) const {
+                return {Op::sub, sub->lhs, sub->rhs};
+            }
+            Binary operator()(const NodeBinExprDiv* div) const {
+                return {Op::div, div->lhs, div->rhs};
+            }
+        };
+        const auto bin_expr = std::get_if<NodeBinExpr*>(&unwrap_parens(expr)->var);
+        if (bin_expr == nullptr) {
+            return {};
+        }
+        return std::visit(BinExprVisitor {}, (*bin_expr)->var);
+    }
+
+    static const NodeTermCall* call(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+        if (term == nullptr) {
+            return nullptr;
+        }
+        const auto term_call = std::get_if<NodeTermCall*>(&(*term)->var);
+        return term_call == nullptr ? nullptr : *term_call;
+    }
+
+    static const NodeTermIdent* ident(const NodeExpr* expr) {
+        const auto term = std::get_if<NodeTerm*>(&unwrap_parens(expr)->var);
+        if (term == nullptr) {
+            return nullptr;
+        }
+        const auto term_ident = std::get_if<NodeTermIdent*>(&(*term)->var);
+        return term_ident == nullptr ? nullptr : *term_ident;
+    }
+
+    // Instructions the one-template-per-operator stack code used for expr.
+    static size_t naive_count(const NodeExpr* expr) {
+        if (const auto bin = as_binary(expr)) {
+            return naive_count(bin->lhs) + naive_count(bin->rhs) + (bin->op == Op::div ? 5 : 4);
+        }
+        if (const NodeTermCall* term_call = call(expr)) {
+            size_t count = 3;
+            for (const NodeExpr* arg : term_call->args) {
+                count += naive_count(arg) + 1;
+            }
+            return count;
+        }
+        return ident(expr) != nullptr ? 1 : 2;
+    }
+
+    int cost(const NodeExpr* expr, Nt nt) const {
+        return m_states.at(unwrap_parens(expr)).at(static_cast<size_t>(nt)).cost;
+    }
+
+    static void match(State& state, Nt nt, Rule rule, int operand_cost, bool swapped = false) {
+        const int cost = std::min(operand_cost + rule_cost(rule), infinite);
+        Choice& choice = state.at(static_cast<size_t>(nt));
+        if (cost < choice.cost) {
+            choice = {.cost = cost, .rule = rule, .swapped = swapped};
+        }
+    }
+
+    void label(const NodeExpr* expr) {
+        expr = unwrap_parens(expr);
+        if (m_states.contains(expr)) {
+            return;
+        }
+        State state;
+        if (m_pinned.contains(expr)) {
+            match(state, Nt::mem, Rule::mem_pinned, 0);
+        }
+        else if (const auto bin = as_binary(expr)) {
+            label(bin->lhs);
+            label(bin->rhs);
+            label_binary(*bin, state);
+        }
+        else if (const auto value = int_lit_value(expr)) {
+            if (*value <= std::numeric_limits<int32_t>::max()) {
+                match(state, Nt::imm, Rule::imm_int_lit, 0);
+            }
+            match(state, Nt::reg, Rule::reg_int_lit, 0);
+        }
+        else if (ident(expr) != nullptr) {
+            match(state, Nt::mem, Rule::mem_ident, 0);
+        }
+        else if (const NodeTermCall* term_call = call(expr)) {
+            int args = 0;
+            for (const NodeExpr* arg : term_call->args) {
+                label(arg);
+                args += cost(arg, Nt::reg);
+            }
+            match(state, Nt::reg, Rule::reg_call, args);
+        }
+        else {
+            match(state, Nt::reg, Rule::reg_int_lit, 0);
+        }
+        // Chain rules
+        match(state, Nt::addr, Rule::addr_bi, state.at(static_cast<size_t>(Nt::base_index)).cost);
+        match(state, Nt::reg, Rule::reg_addr, state.at(static_cast<size_t>(Nt::addr)).cost);
+        match(state, Nt::reg, Rule::reg_imm, state.at(static_cast<size_t>(Nt::imm)).cost);
+        match(state, Nt::reg, Rule::reg_mem, state.at(static_cast<size_t>(Nt::mem)).cost);
+        match(state, Nt::index, Rule::index_reg, state.at(static_cast<size_t>(Nt::reg)).cost);
+        m_states[expr] = state;
+    }
+
+    void label_binary(const Binary& bin, State& state) const {
+        switch (bin.op) {
+            case Op::add:
+                for (const bool swapped : {false, true}) {
+                    const NodeExpr* l = swapped ? bin.rhs : bin.lhs;
+                    const NodeExpr* r = swapped ? bin.lhs : bin.rhs;
+                    match(state, Nt::reg, Rule::add_reg_imm, cost(l, Nt::reg) + cost(r, Nt::imm), swapped);
+                    match(state, Nt::reg, Rule::add_reg_mem, cost(l, Nt::reg) + cost(r, Nt::mem), swapped);
+                    match(state, Nt::base_index, Rule::bi_add, cost(l, Nt::reg) + cost(r, Nt::index), swapped);
+                    match(state, Nt::addr, Rule::addr_bi_disp, cost(l, Nt::base_index) + cost(r, Nt::imm), swapped);
+                    match(state, Nt::addr, Rule::addr_reg_disp, cost(l, Nt::reg) + cost(r, Nt::imm), swapped);
+                }
+                match(state, Nt::reg, Rule::add_reg_reg, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::reg));
+                break;
+            case Op::sub:
+                match(state, Nt::reg, Rule::sub_reg_imm, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::imm));
+                match(state, Nt::reg, Rule::sub_reg_mem, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::mem));
+                match(state, Nt::reg, Rule::sub_reg_reg, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::reg));
+                break;
+            case Op::mul:
+                for (const bool swapped : {false, true}) {
+                    const NodeExpr* l = swapped ? bin.rhs : bin.lhs;
+                    const NodeExpr* r = swapped ? bin.lhs : bin.rhs;
+                    if (const auto value = int_lit_value(r)) {
+                        if (*value == 1 || *value == 2 || *value == 4 || *value == 8) {
+                            match(state, Nt::index, Rule::index_mul, cost(l, Nt::reg), swapped);
+                        }
+                        if (*value == 3 || *value == 5 || *value == 9) {
+                            match(state, Nt::base_index, Rule::bi_mul, cost(l, Nt::reg), swapped);
+                        }
+                        if (std::has_single_bit(*value)) {
+                            match(state, Nt::reg, Rule::mul_shift, cost(l, Nt::reg), swapped);
+                        }
+                    }
+                    match(state, Nt::reg, Rule::mul_mem_imm, cost(l, Nt::mem) + cost(r, Nt::imm), swapped);
+                    match(state, Nt::reg, Rule::mul_reg_imm, cost(l, Nt::reg) + cost(r, Nt::imm), swapped);
+                    match(state, Nt::reg, Rule::mul_reg_mem, cost(l, Nt::reg) + cost(r, Nt::mem), swapped);
+                }
+                match(state, Nt::reg, Rule::mul_reg_reg, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::reg));
+                break;
+            case Op::div:
+                if (const auto value = int_lit_value(bin.rhs)) {
+                    if (std::has_single_bit(*value)) {
+                        match(state, Nt::reg, Rule::div_shift, cost(bin.lhs, Nt::reg));
+                    }
+                    else if (magic_divisor(*value).has_value()) {
+                        match(state, Nt::reg, Rule::div_magic, cost(bin.lhs, Nt::reg));
+                    }
+                }
+                match(state, Nt::reg, Rule::div_reg_mem, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::mem));
+                match(state, Nt::reg, Rule::div_reg_reg, cost(bin.lhs, Nt::reg) + cost(bin.rhs, Nt::reg));
+                break;
+        }
+    }
+
+    const Choice& choice(const NodeExpr* expr, Nt nt) const {
+        const Choice& choice = m_states.at(expr).at(static_cast<size_t>(nt));
+        assert(choice.rule != Rule::none);
+        return choice;
+    }
+
+    static std::pair<const NodeExpr*, const NodeExpr*> operands(const NodeExpr* expr, bool swapped) {
+        const Binary bin = as_binary(expr).value();
+        if (swapped) {
+            return {bin.rhs, bin.lhs};
+        }
+        return {bin.lhs, bin.rhs};
+    }
+
+    void emit(const std::string& instr) {
+        m_output << "    " << instr << "\n";
+        m_stats.selected++;
+    }
+
+    std::string imm(const NodeExpr* expr) const {
+        return std::to_string(int_lit_value(expr).value());
+    }
+
+    std::string mem(const NodeExpr* expr) const {
+        if (const auto it = m_pinned.find(unwrap_parens(expr)); it != m_pinned.end()) {
+            return it->second;
+        }
+        return m_var_operand(ident(expr)->ident);
+    }
+
+    // Evaluates expr into a second register while dst is live. Falls back to rax, which never holds
+    // a live value between rules, by spilling dst when every register is taken.
+    std::string second_reg(const NodeExpr* expr, const std::string& dst) {
+        if (!m_free.empty()) {
+            std::string reg = take();
+            reduce_reg(expr, reg);
+            return reg;
+        }
+        m_push(dst);
+        m_stats.selected++;
+        reduce_reg(expr, dst);
+        emit("mov rax, " + dst);
+        m_pop(dst);
+        m_stats.selected++;
+        return "rax";
+    }
+
+    std::string take() {
+        std::string reg = m_free.back();
+        m_free.pop_back();
+        m_touched.insert(reg);
+        return reg;
+    }
+
+    void release(const std::string& reg) {
+        if (reg != "rax") {
+            m_free.push_back(reg);
+        }
+    }
+
+    void reduce_reg(const NodeExpr* expr, const std::string& dst) {
+        expr = unwrap_parens(expr);
+        const Choice& chosen = choice(expr, Nt::reg);
+        switch (chosen.rule) {
+            case Rule::reg_int_lit: {
+                const auto term = std::get<NodeTerm*>(expr->var);
+                emit("mov " + dst + ", " + std::get<NodeTermIntLit*>(term->var)->int_lit.value.value());
+                return;
+            }
+            case Rule::reg_imm:
+                emit("mov " + dst + ", " + imm(expr));
+                return;
+            case Rule::reg_mem:
+                emit("mov " + dst + ", " + mem(expr));
+                return;
+            case Rule::reg_call:
+                reduce_call(call(expr), dst);
+                return;
+            case Rule::reg_addr: {
+                std::vector<std::string> temps;
+                const std::string addr = reduce_addr(expr, Nt::addr, dst, temps);
+                emit("lea " + dst + ", [" + addr + "]");
+                for (const std::string& reg : temps) {
+                    release(reg);
+                }
+                return;
+            }
+            default:
+                break;
+        }
+        const auto [l, r] = operands(expr, chosen.swapped);
+        // Operand of the instruction itself, 32-bit if expr is narrow
+        const bool narrow = m_narrow.contains(expr);
+        const auto op = [&](const std::string& operand) {
+            return narrow ? dword(operand) : operand;
+        };
+        switch (chosen.rule) {
+            case Rule::add_reg_imm:
+                reduce_reg(l, dst);
+                emit("add " + op(dst) + ", " + imm(r));
+                break;
+            case Rule::add_reg_mem:
+                reduce_reg(l, dst);
+                emit("add " + op(dst) + ", " + op(mem(r)));
+                break;
+            case Rule::add_reg_reg:
+                reduce_binary("add", l, r, dst, narrow);
+                break;
+            case Rule::sub_reg_imm:
+                reduce_reg(l, dst);
+                emit("sub " + op(dst) + ", " + imm(r));
+                break;
+            case Rule::sub_reg_mem:
+                reduce_reg(l, dst);
+                emit("sub " + op(dst) + ", " + op(mem(r)));
+                break;
+            case Rule::sub_reg_reg:
+                reduce_binary("sub", l, r, dst, narrow);
+                break;
+            case Rule::mul_shift: {
+                reduce_reg(l, dst);
+                const int shift = std::countr_zero(int_lit_value(r).value());
+                if (shift != 0) {
+                    emit("shl " + dst + ", " + std::to_string(shift));
+                }
+                break;
+            }
+            case Rule::mul_mem_imm:
+                emit("imul " + op(dst) + ", " + op(mem(l)) + ", " + imm(r));
+                break;
+            case Rule::mul_reg_imm:
+                reduce_reg(l, dst);
+                emit("imul " + op(dst) + ", " + op(dst) + ", " + imm(r));
+                break;
+            case Rule::mul_reg_mem:
+                reduce_reg(l, dst);
+                emit("imul " + op(dst) + ", " + op(mem(r)));
+                break;
+            case Rule::mul_reg_reg:
+                reduce_binary("imul", l, r, dst, narrow);
+                break;
+            case Rule::div_shift: {
+                reduce_reg(l, dst);
+                const int shift = std::countr_zero(int_lit_value(r).value());
+                if (shift != 0) {
+                    emit("shr " + dst + ", " + std::to_string(shift));
+                }
+                break;
+            }
+            case Rule::div_magic: {
+                const MagicDivisor magic = magic_divisor(int_lit_value(r).value()).value();
+                reduce_reg(l, dst);
+                emit("mov rax, " + std::to_string(magic.multiplier));
+                emit("mul " + dst);
+                if (magic.add) {
+                    emit("sub " + dst + ", rdx");
+                    emit("shr " + dst + ", 1");
+                    emit("add " + dst + ", rdx");
+                    if (magic.shift != 0) {
+                        emit("shr " + dst + ", " + std::to_string(magic.shift));
+                    }
+                }
+                else {
+                    if (magic.shift != 0) {
+                        emit("shr rdx, " + std::to_string(magic.shift));
+                    }
+                    emit("mov " + dst + ", rdx");
+                }
+                break;
+            }
+            case Rule::div_reg_mem:
+                reduce_reg(l, dst);
+                emit("mov " + op("rax") + ", " + op(dst));
+                emit("xor edx, edx");
+                emit("div " + op(mem(r)));
+                emit("mov " + op(dst) + ", " + op("rax"));
+                break;
+            case Rule::div_reg_reg: {
+                reduce_reg(l, dst);
+                const std::string divisor = second_reg(r, dst);
+                if (divisor == "rax") {
+                    emit("xchg " + op("rax") + ", " + op(dst));
+                    emit("xor edx, edx");
+                    emit("div " + op(dst));
+                }
+                else {
+                    emit("mov " + op("rax") + ", " + op(dst));
+                    emit("xor edx, edx");
+                    emit("div " + op(divisor));
+                }
+                emit("mov " + op(dst) + ", " + op("rax"));
+                release(divisor);
+                break;
+            }
+            default:
+                assert(false);
+        }
+    }
+
+    void reduce_binary(const std::string& instr, const NodeExpr* lhs, const NodeExpr* rhs, const std::string& dst, bool narrow) {
+        reduce_reg(lhs, dst);
+        const std::string reg = second_reg(rhs, dst);
+        if (narrow) {
+            emit(instr + " " + dword(dst) + ", " + dword(reg));
+        }
+        else {
+            emit(instr + " " + dst + ", " + reg);
+        }
+        release(reg);
+    }
+
+    // The low 32 bits of a register or QWORD memory operand.
+    static std::string dword(const std::string& operand) {
+        if (operand.starts_with("QWORD ")) {
+            return "DWORD " + operand.substr(std::string_view("QWORD ").size());
+        }
+        return std::string(reg32(operand).value());
+    }
+
+    // Saves the caller-saved registers holding live values and evaluates the arguments in source
+    // order, like the inliner and the evaluator: the first six are pushed and then popped into their
+    // registers, the rest are stored into slots reserved below the saved registers, where the callee
+    // expects them.
+    void reduce_call(const NodeTermCall* term_call, const std::string& dst) {
+        std::vector<std::string> saved;
+        for (const std::string_view reg : pool) {
+            if (!is_callee_saved(reg) && reg != dst && std::ranges::find(m_free, reg) == m_free.end()) {
+                saved.emplace_back(reg);
+                m_push(saved.back());
+                m_stats.selected++;
+            }
+        }
+        const size_t count = term_call->args.size();
+        const size_t in_regs = std::min(count, arg_regs.size());
+        for (size_t i = in_regs; i < count; i++) {
+            // Any register will do, the slot is overwritten below
+            m_push("rax");
+            m_stats.selected++;
+        }
+        for (size_t i = 0; i < count; i++) {
+            reduce_reg(term_call->args.at(i), dst);
+            if (i < in_regs) {
+                m_push(dst);
+                m_stats.selected++;
+            }
+            else {
+                emit("mov QWORD [rsp + " + std::to_string((in_regs + i - arg_regs.size()) * 8) + "], " + dst);
+            }
+        }
+        for (size_t i = in_regs; i-- > 0;) {
+            m_pop(std::string(arg_regs.at(i)));
+            m_stats.selected++;
+        }
+        emit("call " + func_label(term_call->ident.value.value()));
+        // Drop the stack arguments; rdx is free again once the call returns.
+        for (size_t i = arg_regs.size(); i < count; i++) {
+            m_pop("rdx");
+            m_stats.selected++;
+        }
+        emit("mov " + dst + ", rax");
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            m_pop(*it);
+            m_stats.selected++;
+        }
+    }
+
+    // Evaluates the registers of an address with its base in dst and returns it as "base + index*scale + disp".
+    std::string reduce_addr(const NodeExpr* expr, Nt nt, const std::string& dst, std::vector<std::string>& temps) {
+        expr = unwrap_parens(expr);
+        const Choice& chosen = choice(expr, nt);
+        if (chosen.rule == Rule::addr_bi) {
+            return reduce_addr(expr, Nt::base_index, dst, temps);
+        }
+        const auto [l, r] = operands(expr, chosen.swapped);
+        switch (chosen.rule) {
+            case Rule::addr_bi_disp:
+                return reduce_addr(l, Nt::base_index, dst, temps) + " + " + imm(r);
+            case Rule::addr_reg_disp:
+                reduce_reg(l, dst);
+                return dst + " + " + imm(r);
+            case Rule::bi_add:
+                reduce_reg(l, dst);
+                return dst + " + " + reduce_index(r, dst, temps);
+            case Rule::bi_mul:
+                reduce_reg(l, dst);
+                return dst + " + " + dst + "*" + std::to_string(int_lit_value(r).value() - 1);
+            default:
+                assert(false);
+                return {};
+        }
+    }
+
+    std::string reduce_index(const NodeExpr* expr, const std::string& dst, std::vector<std::string>& temps) {
+        expr = unwrap_parens(expr);
+        const Choice& chosen = choice(expr, Nt::index);
+        if (chosen.rule == Rule::index_reg) {
+            temps.push_back(second_reg(expr, dst));
+            return temps.back();
+        }
+        const auto [l, r] = operands(expr, chosen.swapped);
+        temps.push_back(second_reg(l, dst));
+        return temps.back() + "*" + imm(r);
+    }
+
+    std::stringstream& m_output;
+    std::function<std::string(const Token&)> m_var_operand;
+    std::function<void(const std::string&)> m_push;
+    std::function<void(const std::string&)> m_pop;
+    std::unordered_map<const NodeExpr*, State> m_states {};
+    std::unordered_map<const NodeExpr*, std::string> m_pinned {};
+    std::unordered_set<const NodeExpr*> m_narrow {};
+    std::vector<std::string> m_free {pool.begin(), pool.end()};
+    std::unordered_set<std::string> m_touched {};
+    Stats m_stats {};
+};
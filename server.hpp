@@ -0,0 +1,380 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// `royc --server` keeps compilers running behind a Unix domain socket so that a build issuing many
+// small compiles pays for process startup once, and `royc --connect` is the client it talks to.
+//
+// Both directions are a sequence of fields, each a little-endian 64-bit length followed by its
+// bytes. A request is the client's working directory followed by its arguments and ends when the
+// client shuts down its side of the connection. The response is the exit status as decimal text,
+// then everything the compile wrote to std::cout, then everything it wrote to std::cerr, then the
+// name its output files were written under.
+//
+// Workers compile concurrently in the client's directory, so a request that does not pick its own
+// -o=<name> is given one unique to it. The client then moves those files to out.*, as a compile
+// run directly would have named them.
+//
+// The workers are forked processes, so none of this exists on Windows.
+
+using CompileFn = std::function<int(const std::vector<std::string>&)>;
+
+inline void append_field(std::string& message, std::string_view field) {
+    const uint64_t size = field.size();
+    for (size_t i = 0; i < sizeof(size); i++) {
+        message.push_back(static_cast<char>(size >> (8 * i)));
+    }
+    message.append(field);
+}
+
+inline std::optional<std::vector<std::string>> split_fields(std::string_view message) {
+    std::vector<std::string> fields;
+    while (!message.empty()) {
+        if (message.size() < sizeof(uint64_t)) {
+            return {};
+        }
+        uint64_t size = 0;
+        for (size_t i = 0; i < sizeof(size); i++) {
+            size |= static_cast<uint64_t>(static_cast<unsigned char>(message[i])) << (8 * i);
+        }
+        message.remove_prefix(sizeof(size));
+        if (size > message.size()) {
+            return {};
+        }
+        fields.emplace_back(message.substr(0, size));
+        message.remove_prefix(size);
+    }
+    return fields;
+}
+
+#ifndef _WIN32
+
+inline std::string default_socket_path() {
+    return "/tmp/royc-" + std::to_string(getuid()) + ".sock";
+}
+
+inline bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        const ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+    return true;
+}
+
+// Reads until the peer shuts down its side.
+inline std::optional<std::string> read_all(int fd) {
+    std::string data;
+    char buffer[64 * 1024];
+    while (true) {
+        const ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return {};
+        }
+        if (got == 0) {
+            return data;
+        }
+        data.append(buffer, static_cast<size_t>(got));
+    }
+}
+
+// The -o=<name> among args, the last one if repeated, or nothing if there is none.
+inline std::string output_name(const std::vector<std::string>& args) {
+    std::string output;
+    for (const std::string& arg : args) {
+        if (arg.starts_with("-o=")) {
+            output = arg.substr(std::string("-o=").size());
+        }
+    }
+    return output;
+}
+
+inline std::optional<sockaddr_un> socket_address(const std::string& path) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return {};
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+// Serves compiles with a pool of worker processes that all accept on the same socket. Workers are
+// processes rather than threads because the compiler reports errors by calling exit(): a failed
+// compile ends its worker, which first sends the response, and the server starts a new one. Every
+// other request leaves the worker warm, with its arenas, heap and iostreams ready for the next.
+// A worker that cannot accept, or a fork that fails, is retried with a doubling delay; after
+// max_failures of those in a row the server stops its workers and exits instead of spinning.
+class CompileServer {
+public:
+    inline CompileServer(std::string path, size_t workers, CompileFn compile)
+        : m_path(std::move(path))
+        , m_workers(workers == 0 ? 1 : workers)
+        , m_compile(std::move(compile))
+    {}
+
+    [[nodiscard]] int run() {
+        const std::optional<sockaddr_un> addr = socket_address(m_path);
+        if (!addr.has_value()) {
+            std::cerr << "[Server Error] Socket path too long: " << m_path << std::endl;
+            return EXIT_FAILURE;
+        }
+        const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            std::cerr << "[Server Error] Could not create socket" << std::endl;
+            return EXIT_FAILURE;
+        }
+        unlink(m_path.c_str());
+        if (bind(listener, reinterpret_cast<const sockaddr*>(&addr.value()), sizeof(sockaddr_un)) != 0
+            || listen(listener, SOMAXCONN) != 0) {
+            std::cerr << "[Server Error] Could not listen on " << m_path << std::endl;
+            close(listener);
+            return EXIT_FAILURE;
+        }
+        // A client that goes away must not take its worker with it
+        signal(SIGPIPE, SIG_IGN);
+        std::cout << "Serving on " << m_path << " with " << m_workers << " workers" << std::endl;
+        size_t failures = 0;
+        for (size_t i = 0; i < m_workers; i++) {
+            if (!replace_worker(listener, failures)) {
+                return shut_down(listener);
+            }
+        }
+        while (true) {
+            int status = 0;
+            const pid_t pid = wait(&status);
+            if (pid < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            m_children.erase(pid);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == worker_failure) {
+                failures++;
+            }
+            else {
+                failures = 0;
+            }
+            if (!replace_worker(listener, failures)) {
+                return shut_down(listener);
+            }
+        }
+        close(listener);
+        return EXIT_SUCCESS;
+    }
+
+private:
+    // The request a worker is compiling, for the exit handler to answer if the compile exits
+    struct InFlight {
+        int conn;
+        const std::stringstream* out;
+        const std::stringstream* err;
+        const std::string* output;
+    };
+
+    static inline InFlight* in_flight = nullptr;
+
+    // Exit status of a worker that could not accept, as opposed to one ended by a failed compile
+    static constexpr int worker_failure = 125;
+    static constexpr size_t max_failures = 8;
+
+    static void respond(int conn, int status, std::string_view out, std::string_view err, std::string_view output) {
+        std::string response;
+        append_field(response, std::to_string(status));
+        append_field(response, out);
+        append_field(response, err);
+        append_field(response, output);
+        write_all(conn, response);
+        close(conn);
+    }
+
+    static void answer_in_flight() {
+        if (in_flight != nullptr) {
+            respond(in_flight->conn, EXIT_FAILURE, in_flight->out->str(), in_flight->err->str(), *in_flight->output);
+            in_flight = nullptr;
+        }
+    }
+
+    // Starts a worker, waiting 50ms, 100ms, 200ms, ... first while the previous attempts have been
+    // failing. Returns false once failures reaches max_failures.
+    [[nodiscard]] bool replace_worker(int listener, size_t& failures) {
+        while (failures < max_failures) {
+            if (failures > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50) * (1 << (failures - 1)));
+            }
+            if (spawn(listener)) {
+                return true;
+            }
+            failures++;
+        }
+        return false;
+    }
+
+    int shut_down(int listener) {
+        std::cerr << "[Server Error] Workers keep failing, shutting down" << std::endl;
+        for (const pid_t pid : m_children) {
+            kill(pid, SIGTERM);
+        }
+        while (!m_children.empty()) {
+            const pid_t pid = wait(nullptr);
+            if (pid < 0 && errno != EINTR) {
+                break;
+            }
+            m_children.erase(pid);
+        }
+        close(listener);
+        return EXIT_FAILURE;
+    }
+
+    [[nodiscard]] bool spawn(int listener) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "[Server Error] Could not start a worker" << std::endl;
+            return false;
+        }
+        if (pid == 0) {
+            std::atexit(answer_in_flight);
+            work(listener);
+        }
+        m_children.insert(pid);
+        return true;
+    }
+
+    [[noreturn]] void work(int listener) {
+        while (true) {
+            const int conn = accept(listener, nullptr, nullptr);
+            if (conn < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                _exit(worker_failure);
+            }
+            serve(conn);
+        }
+    }
+
+    void serve(int conn) {
+        const std::optional<std::string> request = read_all(conn);
+        std::optional<std::vector<std::string>> fields;
+        if (request.has_value()) {
+            fields = split_fields(request.value());
+        }
+        if (!fields.has_value() || fields.value().empty()) {
+            respond(conn, EXIT_FAILURE, "", "[Server Error] Malformed request\n", "");
+            return;
+        }
+        const std::string& cwd = fields.value().front();
+        std::vector<std::string> args(fields.value().begin() + 1, fields.value().end());
+        if (chdir(cwd.c_str()) != 0) {
+            respond(conn, EXIT_FAILURE, "", "[Server Error] Could not enter " + cwd + "\n", "");
+            return;
+        }
+        std::string output = output_name(args);
+        if (output.empty()) {
+            output = ".royc-" + std::to_string(getpid()) + "-" + std::to_string(m_served);
+            args.push_back("-o=" + output);
+        }
+        m_served++;
+        std::stringstream out;
+        std::stringstream err;
+        std::streambuf* const cout_buf = std::cout.rdbuf(out.rdbuf());
+        std::streambuf* const cerr_buf = std::cerr.rdbuf(err.rdbuf());
+        InFlight request_in_flight {.conn = conn, .out = &out, .err = &err, .output = &output};
+        in_flight = &request_in_flight;
+        int status = EXIT_FAILURE;
+        try {
+            status = m_compile(args);
+        }
+        catch (...) {
+            err << "[Server Error] Compilation aborted" << std::endl;
+        }
+        in_flight = nullptr;
+        std::cout.rdbuf(cout_buf);
+        std::cerr.rdbuf(cerr_buf);
+        respond(conn, status, out.str(), err.str(), output);
+    }
+
+    const std::string m_path;
+    const size_t m_workers;
+    const CompileFn m_compile;
+    std::unordered_set<pid_t> m_children {};
+    // Requests this worker has served
+    size_t m_served = 0;
+};
+
+// Sends a compile to the server at path and replays its output and exit status as if it had run here.
+inline int run_client(const std::string& path, const std::vector<std::string>& args) {
+    const std::optional<sockaddr_un> addr = socket_address(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!addr.has_value() || fd < 0
+        || connect(fd, reinterpret_cast<const sockaddr*>(&addr.value()), sizeof(sockaddr_un)) != 0) {
+        std::cerr << "[Server Error] Could not connect to " << path << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+    std::string request;
+    append_field(request, std::filesystem::current_path().string());
+    for (const std::string& arg : args) {
+        append_field(request, arg);
+    }
+    std::optional<std::string> response;
+    if (write_all(fd, request) && shutdown(fd, SHUT_WR) == 0) {
+        response = read_all(fd);
+    }
+    close(fd);
+    std::optional<std::vector<std::string>> fields;
+    if (response.has_value()) {
+        fields = split_fields(response.value());
+    }
+    if (!fields.has_value() || fields.value().size() != 4) {
+        std::cerr << "[Server Error] Incomplete response from " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string& output = fields.value().at(3);
+    if (output_name(args).empty() && !output.empty()) {
+        for (const char* extension : {".asm", ".o", ".exe"}) {
+            std::error_code ec;
+            if (std::filesystem::exists(output + extension, ec)) {
+                std::filesystem::rename(output + extension, std::string("out") + extension, ec);
+            }
+        }
+    }
+    std::cout << fields.value().at(1) << std::flush;
+    std::cerr << fields.value().at(2) << std::flush;
+    return std::atoi(fields.value().at(0).c_str());
+}
+
+#endif
@@ -1,4 +1,5 @@
 #pragma once
+#include <cassert>
 #include <string>
 #include <iostream>
 #include <optional>
@@ -24,9 +25,13 @@ enum class TokenType {
     if_,
     elif,
     else_,
+    while_,
+    fn,
+    return_,
+    comma,
 };
 
-inline bool is_bin_op(TokenType type) {
+constexpr bool is_bin_op(TokenType type) {
     switch (type) {
         case TokenType::plus:
         case TokenType::minus:
@@ -39,7 +44,7 @@ inline bool is_bin_op(TokenType type) {
 
     }
 }
-inline const char *to_string(const TokenType &type) {
+constexpr const char *to_string(const TokenType &type) {
     switch (type) {
         case TokenType::exit:
             return "`exit`";
@@ -75,11 +80,19 @@ inline const char *to_string(const TokenType &type) {
             return "`elif`";
         case TokenType::else_:
             return "`else`";
+        case TokenType::while_:
+            return "`while`";
+        case TokenType::fn:
+            return "`fn`";
+        case TokenType::return_:
+            return "`return`";
+        case TokenType::comma:
+            return "`,`";
     }
     assert(false);
 }
 
-inline std::optional<int> bin_prec(TokenType type) {
+constexpr std::optional<int> bin_prec(TokenType type) {
     switch (type) {
         case TokenType::minus:
         case TokenType::plus:
@@ -92,6 +105,20 @@ inline std::optional<int> bin_prec(TokenType type) {
     }
 }
 
+// The <cctype> classifications for ASCII, which unlike those can run at compile time.
+constexpr bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+constexpr bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+constexpr bool is_alnum(char c) {
+    return is_alpha(c) || is_digit(c);
+}
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
 struct Token {
     TokenType type;
     int line;
@@ -100,18 +127,18 @@ struct Token {
 
 class Tokenizer {
 public:
-    inline explicit Tokenizer(std::string  src)
-        : m_src(std::move(src))
+    constexpr explicit Tokenizer(const std::string& src)
+        : m_src(src)
     {}
-    inline std::vector<Token> tokenize() {
+    constexpr std::vector<Token> tokenize() {
         std::vector<Token> tokens;
         std::string buf;
         int line_count = 1;
         while (peek().has_value()) {
             //std::cout << "char  '" << peek().value() << "'\n";
-            if (std::isalpha(peek().value())) {
+            if (is_alpha(peek().value())) {
                 buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
+                while (peek().has_value() && is_alnum(peek().value())) {
                     buf.push_back(consume());
                 }
                 if (buf == "exit") {
@@ -134,14 +161,26 @@ public:
                     tokens.push_back({TokenType::else_, line_count});
                     buf.clear();
                 }
+                else if (buf == "while") {
+                    tokens.push_back({TokenType::while_, line_count});
+                    buf.clear();
+                }
+                else if (buf == "fn") {
+                    tokens.push_back({TokenType::fn, line_count});
+                    buf.clear();
+                }
+                else if (buf == "return") {
+                    tokens.push_back({TokenType::return_, line_count});
+                    buf.clear();
+                }
                 else {
                     tokens.push_back({ TokenType::ident, line_count, buf});
                     buf.clear();
                 }
             }
-            else if (std::isdigit(peek().value())) {
+            else if (is_digit(peek().value())) {
                 buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
+                while (peek().has_value() && is_digit(peek().value())) {
                     buf.push_back(consume());
                }
                 tokens.push_back({ TokenType::int_lit, line_count, buf});
@@ -183,6 +222,10 @@ public:
                 consume();
                 tokens.push_back({TokenType::semi, line_count});
             }
+            else if (peek().value() == ',') {
+                consume();
+                tokens.push_back({TokenType::comma, line_count});
+            }
             else if (peek().value() == '=') {
                 consume();
                 tokens.push_back({TokenType::eq, line_count});
@@ -215,7 +258,7 @@ public:
                 consume();
                 line_count++;
             }
-            else if (std::isspace(peek().value())) {
+            else if (is_space(peek().value())) {
                 consume();
             } else {
                 std::cerr << "Invalid token" << std::endl;
@@ -225,14 +268,14 @@ public:
     }
 
 private:
-    [[nodiscard]] inline std::optional<char> peek(int offset = 0) const {
+    [[nodiscard]] constexpr std::optional<char> peek(int offset = 0) const {
         if (m_index + offset >= m_src.length()) {
             return {};
         } else {
             return m_src.at(m_index + offset);
         }
     }
-    inline char consume() {
+    constexpr char consume() {
         return m_src.at(m_index++);
     }
     const std::string m_src;